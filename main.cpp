@@ -22,34 +22,26 @@
 #include <vector>
 #include <string>
 #include <list>
+#include <set>
+#include <algorithm>
+#include <queue>
 #include <cstdio>
+#include <cmath>
+#include <process.h>
+#include <io.h>
+#include <fcntl.h>
 #include "resource.h"
+#include "packageio.h"
 
 #include "thirdparty/tinyxml/tinyxml.h"
 #include "thirdparty/zlib/zlib.h"
 
 #pragma warning(disable: 4267 4244)
 
-//#define COMPRESS_PACKAGE
 #define EM4_DELUXE
 
-#define FILEVERSION 0x00000101
-
-#ifdef COMPRESS_PACKAGE
-	#define FileType gzFile
-	#define Open gzopen
-	#define Close gzclose
-	#define Seek gzseek
-	#define Tell gztell
-#else
-	#define FileType FILE*
-	#define Open fopen
-	#define Close fclose
-	#define Seek fseek
-	#define Tell ftell
-#endif
-
 #pragma comment (lib, "comctl32.lib")
+#pragma comment (lib, "advapi32.lib")
 
 typedef std::vector<std::string> StringList;
 typedef std::vector<struct ModListInfo*> ModList;
@@ -57,6 +49,20 @@ typedef std::vector<struct ModListInfo*> ModList;
 std::string EM3InstallDir;
 ModList TopLayerMods;
 HWND Dialog = NULL, Progress = NULL;
+int NumWorkerThreads = 0;	// 0 = one per processor, can be set with -threads on the command line
+std::string ProfileFile;	// packing profile given with -profile
+StringList MakePatchArgs;	// -makepatch <old mod folder> <new mod folder> <patch file>
+StringList PackArgs;		// -pack <mod folder> <package or - for stdout>
+StringList ExtractArgs;		// -extract <package> <pattern> <folder>
+StringList CatArgs;			// -cat <package> <path inside the mod>
+bool Headless = false;		// run from the command line, errors go to stderr
+bool FullRepack = false;	// -full compresses everything again instead of reusing the package that is replaced
+int PackChunkSize = 0;		// 0 = default, can be set in KB with -chunksize on the command line
+int SolidBlockSize = 0;		// -solid <KB> packs small files into shared chunks of up to this size, 0 = off
+bool UseDictionary = true;	// -nodictionary packs text without a preset dictionary
+bool ShowStats = false;		// -stats prints the unpacking statistics of -extract to stderr
+std::string PackReport;		// compression statistics of the last package
+std::string InstallReport;	// unpacking statistics of the last install
 
 struct ModInfo
 {
@@ -65,21 +71,6 @@ struct ModInfo
 	std::string Comment;
 };
 
-struct FileEntry
-{
-	std::string Fullpath;
-	std::string Name;
-	int DataOffset;
-	int DataSize;
-};
-
-struct ModContents
-{
-	std::string Name;
-	std::list<FileEntry*> Files;
-	std::list<ModContents*> SubFolders;
-};
-
 struct ModListInfo
 {
 	ModInfo Info;
@@ -88,13 +79,8 @@ struct ModListInfo
 	ModContents Contents;
 };
 
-struct ModPackageHeader
-{
-	char ID[5];		// E3MP
-	int Version;	// 0x00000101	
-};
-
 bool InitMods();
+bool ApplyPatch(FileType f, const ModPackageHeader &h, const std::string &Dictionary, const std::string &InstallPath);
 
 class CComputerCheckSum
 {
@@ -170,34 +156,142 @@ private:
 };
 
 
-int Write(FileType f, const void *data, int size)
+void PumpMessages()
 {
-#ifdef COMPRESS_PACKAGE
-	return gzwrite(f, data, size);
-#else
-	return fwrite(data, 1, size, f);
-#endif
+	MSG msg;
+	if(PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+	{
+		if(!IsDialogMessage(Dialog, &msg))
+		{
+			TranslateMessage(&msg);
+			DispatchMessage(&msg);
+		}
+	}
 }
 
-int Read(FileType f, void *data, int size)
+// waits for a worker thread event while keeping the dialogs alive
+void WaitPumping(HANDLE h)
 {
-#ifdef COMPRESS_PACKAGE
-	return gzread(f, data, size);
-#else
-	return fread(data, 1, size, f);
-#endif
+	while(MsgWaitForMultipleObjects(1, &h, FALSE, INFINITE, QS_ALLINPUT) != WAIT_OBJECT_0)
+	{
+		MSG msg;
+		while(PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+		{
+			if(!IsDialogMessage(Dialog, &msg))
+			{
+				TranslateMessage(&msg);
+				DispatchMessage(&msg);
+			}
+		}
+	}
 }
 
-int Rewind(FileType f)
+// the dialog, or stderr when run from the command line
+void ShowError(const std::string &Message, const char *Caption)
 {
-#ifdef COMPRESS_PACKAGE
-	return gzrewind(f);
-#else
-	rewind(f);
-	return 1;
-#endif
+	if(Headless)
+		fprintf(stderr, "%s: %s\n", Caption, Message.c_str());
+	else
+		MessageBox(Dialog, Message.c_str(), Caption, MB_OK | MB_ICONSTOP);
+}
+
+#define MAX_WORKER_THREADS 64
+
+int GetWorkerThreadCount()
+{
+	if(NumWorkerThreads > 0)
+		return NumWorkerThreads;
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	if(si.dwNumberOfProcessors > MAX_WORKER_THREADS)
+		return MAX_WORKER_THREADS;
+	return si.dwNumberOfProcessors > 0 ? si.dwNumberOfProcessors : 1;
 }
 
+class CWorkerJob
+{
+public:
+	virtual ~CWorkerJob() {}
+	virtual void Run(WorkerContext *Context) = 0;
+};
+
+class CWorkerPool
+{
+public:
+	CWorkerPool(int NumThreads)
+	{
+		mQuit = false;
+		InitializeCriticalSection(&mLock);
+		mJobsAvailable = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+		for(int i = 0; i < NumThreads; i++)
+		{
+			HANDLE t = (HANDLE)_beginthreadex(NULL, 0, ThreadProc, this, 0, NULL);
+			if(t)
+				mThreads.push_back(t);
+		}
+	}
+	~CWorkerPool()
+	{
+		EnterCriticalSection(&mLock);
+		mQuit = true;
+		LeaveCriticalSection(&mLock);
+		ReleaseSemaphore(mJobsAvailable, mThreads.size(), NULL);
+		for(std::vector<HANDLE>::iterator i = mThreads.begin(); i != mThreads.end(); i++)
+		{
+			WaitForSingleObject(*i, INFINITE);
+			CloseHandle(*i);
+		}
+		CloseHandle(mJobsAvailable);
+		DeleteCriticalSection(&mLock);
+	}
+	int GetNumThreads() const
+	{
+		return mThreads.size();
+	}
+	// jobs are not owned by the pool, they have to signal their own completion
+	void Submit(CWorkerJob *Job)
+	{
+		if(mThreads.empty())
+		{
+			Job->Run(&mInlineContext);
+			return;
+		}
+		EnterCriticalSection(&mLock);
+		mJobs.push_back(Job);
+		LeaveCriticalSection(&mLock);
+		ReleaseSemaphore(mJobsAvailable, 1, NULL);
+	}
+
+private:
+	static unsigned __stdcall ThreadProc(void *Param)
+	{
+		CWorkerPool *Pool = reinterpret_cast<CWorkerPool*>(Param);
+		WorkerContext Context;
+		for(;;)
+		{
+			WaitForSingleObject(Pool->mJobsAvailable, INFINITE);
+			EnterCriticalSection(&Pool->mLock);
+			if(Pool->mQuit)
+			{
+				LeaveCriticalSection(&Pool->mLock);
+				break;
+			}
+			CWorkerJob *Job = Pool->mJobs.front();
+			Pool->mJobs.pop_front();
+			LeaveCriticalSection(&Pool->mLock);
+			Job->Run(&Context);
+		}
+		return 0;
+	}
+
+	CRITICAL_SECTION mLock;
+	HANDLE mJobsAvailable;
+	std::list<CWorkerJob*> mJobs;
+	std::vector<HANDLE> mThreads;
+	WorkerContext mInlineContext;	// used when no thread could be started
+	bool mQuit;
+};
+
 bool GetInstallDir()
 {
 
@@ -257,17 +351,68 @@ std::string ChooseDestinationPackage()
 	return "";
 }
 
-bool ScanSubFolder(ModContents *Target, const std::string &Path)
+__int64 FileTimeToInt64(const FILETIME &Time)
 {
-	assert(Target);
-	if(!Target)
-		return false;
-	
-	std::string Pattern = Path + "\\*.*";	
-	WIN32_FIND_DATA fd;
-	HANDLE h = FindFirstFile(Pattern.c_str(), &fd);
-	if(h != INVALID_HANDLE_VALUE)
+	return ((__int64)Time.dwHighDateTime << 32) | Time.dwLowDateTime;
+}
+
+// Lists a folder tree on all cores. Every folder is a job that lists its own entries and hands
+// its subfolders on to whichever worker is free, so wide and deep trees spread alike. Each list
+// is filled by one job in FindFirstFile order, so the tree is the same a recursive walk builds.
+class CTreeScanner
+{
+public:
+	CTreeScanner() : mPool(GetWorkerThreadCount())
+	{
+		mPending = 0;
+		mDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	}
+	~CTreeScanner()
+	{
+		CloseHandle(mDone);
+	}
+
+	void Scan(ModContents *Target, const std::string &Path)
+	{
+		ResetEvent(mDone);
+		Target->Path = Path;
+		Queue(Target);
+		WaitPumping(mDone);
+	}
+
+private:
+	struct FolderJob : public CWorkerJob
+	{
+		CTreeScanner *Scanner;
+		ModContents *Target;
+
+		void Run(WorkerContext *Context)
+		{
+			CTreeScanner *s = Scanner;
+			s->ScanFolder(Target);
+			delete this;
+			if(InterlockedDecrement(&s->mPending) == 0)
+				SetEvent(s->mDone);
+		}
+	};
+
+	void Queue(ModContents *Target)
 	{
+		FolderJob *Job = new FolderJob;
+		Job->Scanner = this;
+		Job->Target = Target;
+		InterlockedIncrement(&mPending);
+		mPool.Submit(Job);
+	}
+
+	// size and write time come with the listing, so the packer never has to ask for them
+	void ScanFolder(ModContents *Target)
+	{
+		std::string Pattern = Target->Path + "\\*.*";
+		WIN32_FIND_DATA fd;
+		HANDLE h = FindFirstFile(Pattern.c_str(), &fd);
+		if(h == INVALID_HANDLE_VALUE)
+			return;
 		do 
 		{
 			if(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
@@ -276,22 +421,34 @@ bool ScanSubFolder(ModContents *Target, const std::string &Path)
 				{
 					ModContents *con = new ModContents;
 					con->Name = fd.cFileName;
+					con->Path = Target->Path + "\\" + fd.cFileName;
 					Target->SubFolders.push_back(con);
-					ScanSubFolder(con, Path + "\\" + fd.cFileName);
+					Queue(con);
 				}
 			} else
 			{
-				FileEntry *e = new FileEntry;
-				e->Fullpath = Path + "\\" + fd.cFileName;
-				e->Name = fd.cFileName;
-				e->DataOffset = e->DataSize = 0;
-				Target->Files.push_back(e);
+				FileEntry *e = AddFileEntry(Target, fd.cFileName);
+				e->DataSize = ((__int64)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+				e->WriteTime = FileTimeToInt64(fd.ftLastWriteTime);
 			}
 		}
 		while(FindNextFile(h, &fd));
 		FindClose(h);
 	}
+
+	CWorkerPool mPool;
+	volatile LONG mPending;		// folders queued or being listed
+	HANDLE mDone;
+};
+
+bool ScanSubFolder(ModContents *Target, const std::string &Path)
+{
+	assert(Target);
+	if(!Target)
+		return false;
 	
+	CTreeScanner Scanner;
+	Scanner.Scan(Target, Path);
 	return true;
 }
 
@@ -305,37 +462,12 @@ bool ScanModContents(int Item)
 	assert(mli);
 	if(!mli)
 		return false;
-		
-	WIN32_FIND_DATA fd;
-	std::string pattern = mli->Path + "\\*.*";
-	HANDLE h = FindFirstFile(pattern.c_str(), &fd);
-	if(h != INVALID_HANDLE_VALUE)
-	{
-		do 
-		{
-			if(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
-			{
-				if(_stricmp(fd.cFileName, ".") && _stricmp(fd.cFileName, ".."))
-				{
-					ModContents *con = new ModContents;
-					con->Name = fd.cFileName;
-					mli->Contents.SubFolders.push_back(con);
-					ScanSubFolder(con, mli->Path + "\\" + fd.cFileName);
-				}
-			} else
-			{
-				FileEntry *e = new FileEntry;
-				e->Name = fd.cFileName;
-				e->DataOffset = e->DataSize = 0;
-				e->Fullpath = mli->Path + "\\" + fd.cFileName;
-				mli->Contents.Files.push_back(e);
-			}
-		}
-		while(FindNextFile(h, &fd));
-		FindClose(h);
-	}
-	
-	return true;
+
+	// the dialog is kept alive while the workers fill mli, but must not start anything else
+	EnableWindow(Dialog, FALSE);
+	bool Result = ScanSubFolder(&mli->Contents, mli->Path);
+	EnableWindow(Dialog, TRUE);
+	return Result;
 }
 
 bool ReadModInfo(ModListInfo *mli)
@@ -392,350 +524,2851 @@ void UpdateModInfoDisplay(int Item)
 	}
 }
 
-bool CopyFiles(FileType File, ModContents *Node)
+#define PIPELINE_MEMORY		0x4000000	// chunk buffers of one pipeline, large chunks must not exhaust the address space
+#define SOLID_MAXFILESIZE	0x4000		// larger files fill a good part of a chunk on their own
+#define DICTIONARY_SAMPLE	0x400000	// text read to build the dictionary
+#define DICTIONARY_MAXFILESIZE	0x10000
+#define DICTIONARY_SEGMENT	64
+#define DICTIONARY_GRAM		8
+#define DICTIONARY_HASHBITS	20
+#define PREFETCH_FILES		64			// files read ahead of the packer at most
+#define PREFETCH_MEMORY		0x4000000	// bytes read ahead of the packer at most
+#define PREFETCH_BLOCKSIZE	0x100000
+
+int GetPackChunkSize()
 {
-	assert(File);
-	assert(Node);
-	
-	MSG msg;
-	if(PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+	if(PackChunkSize <= 0)
+		return DEFAULT_CHUNKSIZE;
+	if(PackChunkSize < MIN_CHUNKSIZE)
+		return MIN_CHUNKSIZE;
+	if(PackChunkSize > MAX_CHUNKSIZE)
+		return MAX_CHUNKSIZE;
+	return PackChunkSize;
+}
+
+// two chunks per worker keep everyone busy, as long as they fit into the memory budget
+int GetPipelineSlots(int NumThreads, int SlotSize)
+{
+	int NumSlots = 2 * NumThreads + 2;
+	if(NumSlots * SlotSize > PIPELINE_MEMORY)
+		NumSlots = PIPELINE_MEMORY / SlotSize;
+	return NumSlots < 2 ? 2 : NumSlots;
+}
+
+// formats that are compressed already, deflate only burns time on them
+const char *StoredExtensions[] = { "ogg", "mp3", "wma", "wmv", "avi", "bik", "jpg", "jpeg", "png", "zip", "rar", "7z", "gz", "e4mod", NULL };
+
+// decides how the files matching Pattern are compressed
+struct PackRule
+{
+	std::string Pattern;	// matched against the file name, or the path inside the mod if it contains a backslash
+	int Level;
+	int Strategy;
+	bool Store;
+
+	// statistics of the last package
+	int NumFiles;
+	double InputBytes;
+	double OutputBytes;
+	LONGLONG Ticks;
+};
+
+typedef std::vector<PackRule> PackProfile;
+PackProfile Profile;
+int NumDuplicateFiles = 0;		// entries of the last package that share the data of an earlier one
+double DuplicateBytes = 0.0;
+int NumReusedFiles = 0;			// unchanged files copied from the package that was replaced
+double ReusedBytes = 0.0;
+int NumSolidFiles = 0;			// small files packed into shared chunks
+int NumSolidBlocks = 0;
+int DictionarySize = 0;			// preset dictionary of the last package
+int NumDictionaryChunks = 0;	// chunks primed with it
+
+bool WildcardMatch(const char *Pattern, const char *String)
+{
+	if(*Pattern == '*')
 	{
-		if(!IsDialogMessage(Dialog, &msg))
+		for(const char *s = String;; s++)
 		{
-			TranslateMessage(&msg);
-			DispatchMessage(&msg);
+			if(WildcardMatch(Pattern+1, s))
+				return true;
+			if(!*s)
+				return false;
 		}
-	}		
+	}
+	if(!*String)
+		return !*Pattern;
+	if(*Pattern != '?' && tolower((unsigned char)*Pattern) != tolower((unsigned char)*String))
+		return false;
+	return WildcardMatch(Pattern+1, String+1);
+}
+
+void AddPackRule(const std::string &Pattern, int Level, int Strategy, bool Store)
+{
+	PackRule r;
+	r.Pattern = Pattern;
+	r.Level = Level;
+	r.Strategy = Strategy;
+	r.Store = Store || Level == 0;
+	Profile.push_back(r);
+}
+
+// Reads the rules of a packing profile:
+// <packprofile>
+//     <rule pattern="*.dds" level="1"/>
+//     <rule pattern="*.xml" level="9" strategy="filtered"/>
+//     <rule pattern="Videos\*" store="1"/>
+// </packprofile>
+bool LoadPackProfile(const std::string &File)
+{
+	TiXmlDocument doc(File.c_str());
+	if(!doc.LoadFile())
+		return false;
+
+	TiXmlElement *root = doc.RootElement();
+	if(!root)
+		return false;
 
-	for(std::list<FileEntry*>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	for(TiXmlElement *rule = root->FirstChildElement("rule"); rule; rule = rule->NextSiblingElement("rule"))
 	{
-		FILE* input = fopen((*i)->Fullpath.c_str(), "rb");
-		if(!input)
+		const wchar_t *p = rule->Attribute("pattern");
+		if(!p)
+			return false;
+		static char temp[0xffff];
+		WideCharToMultiByte(CP_ACP, 0, p, -1, temp, 0xffff, NULL, NULL);
+		std::string Pattern = temp;
+
+		int Level = Z_DEFAULT_COMPRESSION;
+		int Store = 0;
+		rule->Attribute("level", &Level);
+		rule->Attribute("store", &Store);
+		if(Level < Z_DEFAULT_COMPRESSION || Level > Z_BEST_COMPRESSION)
 			return false;
-		
-		int Offs = Tell(File);
-		fseek(input, 0, SEEK_END);
-		int Size = ftell(input);
-		fseek(input, 0, SEEK_SET);
-
-		(*i)->DataOffset = Offs;
-		(*i)->DataSize = Size;
 
-		static unsigned char buffer[0xffff];
-		static unsigned char compbuffer[0x12000];
-		int r = fread(buffer, 1, 0xffff, input);
-		do 
+		int Strategy = Z_DEFAULT_STRATEGY;
+		const wchar_t *s = rule->Attribute("strategy");
+		if(s)
 		{
-			uLongf sc = 0x12000;
-			if(compress(compbuffer, &sc, buffer, r) != Z_OK)
-			{
-				MessageBox(Dialog, "Error while compressing input data", "Fatal error", MB_OK | MB_ICONSTOP);
-				return false;
-			}
-			
-			//int w = Write(File, buffer, r);
-			Write(File, &sc, sizeof(uLongf));	// compressed size
-			Write(File, &r, sizeof(int));		// uncompressed size
-			int w = Write(File, compbuffer, sc);
-			//if(w != r)
-			if(w != sc)
+			WideCharToMultiByte(CP_ACP, 0, s, -1, temp, 0xffff, NULL, NULL);
+			if(!_stricmp(temp, "filtered"))
+				Strategy = Z_FILTERED;
+			else if(!_stricmp(temp, "huffman"))
+				Strategy = Z_HUFFMAN_ONLY;
+			else if(!_stricmp(temp, "rle"))
+				Strategy = Z_RLE;
+			else if(!_stricmp(temp, "fixed"))
+				Strategy = Z_FIXED;
+			else if(_stricmp(temp, "default"))
 				return false;
-			r = fread(buffer, 1, 0xffff, input);
-		} while(r > 0);
-		
-		fclose(input);
+		}
+		AddPackRule(Pattern, Level, Strategy, Store != 0);
+	}
+	return true;
+}
+
+// the rules of the profile file come first, the built-in ones catch everything else
+bool InitPackProfile()
+{
+	Profile.clear();
+	if(ProfileFile.length() > 0 && !LoadPackProfile(ProfileFile))
+		return false;
+	for(const char **e = StoredExtensions; *e; e++)
+		AddPackRule(std::string("*.") + *e, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, true);
+	AddPackRule("*", Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, false);
+
+	for(PackProfile::iterator i = Profile.begin(); i != Profile.end(); i++)
+	{
+		i->NumFiles = 0;
+		i->InputBytes = i->OutputBytes = 0.0;
+		i->Ticks = 0;
+	}
+	return true;
+}
+
+// Root is the mod folder, folders above it must not decide the rule
+PackRule *FindPackRule(const FileEntry *Entry, const std::string &Root)
+{
+	std::string Path = GetPath(Entry);
+	if(Path.length() > Root.length() && !Path.compare(0, Root.length(), Root) && Path[Root.length()] == '\\')
+		Path.erase(0, Root.length() + 1);
+	for(PackProfile::iterator i = Profile.begin(); i != Profile.end(); i++)
+	{
+		if(i->Pattern.find('\\') != std::string::npos)
+		{
+			if(WildcardMatch(i->Pattern.c_str(), Path.c_str()))
+				return &(*i);
+		} else if(WildcardMatch(i->Pattern.c_str(), GetName(Entry)))
+			return &(*i);
+	}
+	return NULL;
+}
+
+const char *GetStrategySuffix(int Strategy)
+{
+	switch(Strategy)
+	{
+		case Z_FILTERED : return ", filtered";
+		case Z_HUFFMAN_ONLY : return ", huffman";
+		case Z_RLE : return ", rle";
+		case Z_FIXED : return ", fixed";
+	}
+	return "";
+}
+
+std::string GetPackReport()
+{
+	LARGE_INTEGER Frequency;
+	QueryPerformanceFrequency(&Frequency);
+
+	std::string Report;
+	for(PackProfile::iterator i = Profile.begin(); i != Profile.end(); i++)
+	{
+		if(i->NumFiles == 0)
+			continue;
+		static char Line[1024];
+		if(i->Store)
+			sprintf(Line, "%s (stored): ", i->Pattern.c_str());
+		else if(i->Level == Z_DEFAULT_COMPRESSION)
+			sprintf(Line, "%s (default level%s): ", i->Pattern.c_str(), GetStrategySuffix(i->Strategy));
+		else
+			sprintf(Line, "%s (level %d%s): ", i->Pattern.c_str(), i->Level, GetStrategySuffix(i->Strategy));
+		Report += Line;
+		sprintf(Line, "%d files, %.1f MB -> %.1f MB (%.1f%%), %.2f s\r\n", i->NumFiles, i->InputBytes / 1048576.0, i->OutputBytes / 1048576.0,
+			i->InputBytes > 0.0 ? 100.0 * i->OutputBytes / i->InputBytes : 100.0, double(i->Ticks) / Frequency.QuadPart);
+		Report += Line;
+	}
+	if(NumDuplicateFiles > 0)
+	{
+		static char Line[256];
+		sprintf(Line, "%d duplicate files stored once, %.1f MB saved\r\n", NumDuplicateFiles, DuplicateBytes / 1048576.0);
+		Report += Line;
+	}
+	if(NumReusedFiles > 0)
+	{
+		static char Line[256];
+		sprintf(Line, "%d unchanged files copied from the previous package, %.1f MB\r\n", NumReusedFiles, ReusedBytes / 1048576.0);
+		Report += Line;
+	}
+	if(NumSolidFiles > 0)
+	{
+		static char Line[256];
+		sprintf(Line, "%d small files in %d solid blocks\r\n", NumSolidFiles, NumSolidBlocks);
+		Report += Line;
+	}
+	if(NumDictionaryChunks > 0)
+	{
+		static char Line[256];
+		sprintf(Line, "%d chunks primed with a %.1f KB dictionary\r\n", NumDictionaryChunks, DictionarySize / 1024.0);
+		Report += Line;
+	}
+	return Report;
+}
+
+// Estimates the entropy of a chunk from a sample of its bytes. Above 7.8 bits per byte
+// deflate saves next to nothing.
+bool LooksIncompressible(const unsigned char *Data, int Size)
+{
+	if(Size < 0x1000)
+		return false;
+
+	int Histogram[256];
+	memset(Histogram, 0, sizeof(Histogram));
+	int Step = Size / 0x1000;
+	int Samples = 0;
+	for(int i = 0; i < Size; i += Step, Samples++)
+		Histogram[Data[i]]++;
+
+	double Entropy = 0.0;
+	for(int i = 0; i < 256; i++)
+	{
+		if(Histogram[i])
+		{
+			double p = double(Histogram[i]) / Samples;
+			Entropy -= p * log(p);
+		}
+	}
+	return Entropy / log(2.0) > 7.8;
+}
+
+// scripts, XML and the like, judged by the first few KB
+bool LooksLikeText(const unsigned char *Data, int Size)
+{
+	if(Size <= 0)
+		return false;
+	if(Size > 0x1000)
+		Size = 0x1000;
+	for(int i = 0; i < Size; i++)
+	{
+		if(Data[i] < 0x20 && Data[i] != '\t' && Data[i] != '\n' && Data[i] != '\r')
+			return false;
+	}
+	return true;
+}
+
+// Where ReadFile would fail, reading a view of the file raises EXCEPTION_IN_PAGE_ERROR, e.g. on a
+// network share that went away or a drive that was removed. Views are only read under __try.
+int FilterPageError(DWORD Code)
+{
+	return Code == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH;
+}
+
+#define VIEW_PAGESIZE	0x1000
+
+// reads every page of a view in, false if one of them could not be read
+bool TouchView(const unsigned char *Data, int Size)
+{
+	__try
+	{
+		volatile unsigned char Sum = 0;
+		for(int i = 0; i < Size; i += VIEW_PAGESIZE)
+			Sum += Data[i];
+		if(Size > 0)
+			Sum += Data[Size - 1];
+	}
+	__except(FilterPageError(GetExceptionCode()))
+	{
+		return false;
+	}
+	return true;
+}
+
+// SHA-1 of file contents
+class CContentHasher
+{
+public:
+	CContentHasher() : mBuffer(0x10000)
+	{
+		mHash = 0;
+		if(!CryptAcquireContext(&mProvider, NULL, NULL, PROV_RSA_FULL, CRYPT_VERIFYCONTEXT))
+			mProvider = 0;
+	}
+	~CContentHasher()
+	{
+		if(mHash)
+			CryptDestroyHash(mHash);
+		if(mProvider)
+			CryptReleaseContext(mProvider, 0);
+	}
+
+	bool Begin()
+	{
+		if(mHash)
+			CryptDestroyHash(mHash);
+		mHash = 0;
+		return mProvider && CryptCreateHash(mProvider, CALG_SHA1, 0, 0, &mHash);
+	}
+
+	void Update(const void *Data, int Size)
+	{
+		if(mHash && !CryptHashData(mHash, reinterpret_cast<const BYTE*>(Data), Size, 0))
+		{
+			CryptDestroyHash(mHash);
+			mHash = 0;
+		}
+	}
+
+	// for data in a view of a file, false if it could not be read
+	bool UpdateView(const unsigned char *Data, int Size)
+	{
+		__try
+		{
+			Update(Data, Size);
+		}
+		__except(FilterPageError(GetExceptionCode()))
+		{
+			return false;
+		}
+		return true;
+	}
+
+	bool End(ContentHash &Digest)
+	{
+		if(!mHash)
+			return false;
+		DWORD Size = sizeof(Digest.Value);
+		Digest.Valid = CryptGetHashParam(mHash, HP_HASHVAL, Digest.Value, &Size, 0) != 0 && Size == sizeof(Digest.Value);
+		bool Result = Digest.Valid;
+		CryptDestroyHash(mHash);
+		mHash = 0;
+		return Result;
+	}
+
+	bool HashFile(const std::string &Path, ContentHash &Digest)
+	{
+		FILE* input = fopen(Path.c_str(), "rb");
+		if(!input)
+			return false;
+		if(!Begin())
+		{
+			fclose(input);
+			return false;
+		}
+
+		int r;
+		while((r = fread(&mBuffer[0], 1, mBuffer.size(), input)) > 0)
+			Update(&mBuffer[0], r);
+		bool Failed = ferror(input) != 0;
+		fclose(input);
+		return End(Digest) && !Failed;
+	}
+
+private:
+	HCRYPTPROV mProvider;
+	HCRYPTHASH mHash;
+	std::vector<unsigned char> mBuffer;
+};
+
+// one chunk on its way through the packing pipeline: read -> compress (any worker) -> write (in order)
+struct CompressSlot : public CWorkerJob
+{
+	FileEntry *Entry;	// only set for the first chunk of a file
+	int NumFiles;		// files starting in this chunk, all members of a solid block
+	bool Last;			// marks the end of the input
+	PackRule *Rule;
+	unsigned char *Buffer;	// owned by the slot
+	unsigned char *Input;	// the buffer, or a view of the source file until the chunk is compressed
+	void *View;				// mapped window Input points into, unmapped by the writer once the chunk is written
+	int InputSize;
+	unsigned char *Output;
+	uLongf OutputCapacity;
+	uLongf OutputSize;
+	bool Stored;		// the chunk is written as it is
+	bool Reused;		// copied from the previous package, Input or Output hold the chunk as it was
+	const std::string *Dictionary;	// NULL if the package has none
+	bool Primed;		// compressed with the dictionary
+	int Result;
+	LONGLONG Ticks;		// time spent compressing
+	HANDLE Done;
+
+	void Run(WorkerContext *Context)
+	{
+		LARGE_INTEGER Start, End;
+		QueryPerformanceCounter(&Start);
+		Result = Z_OK;
+		__try
+		{
+			Stored = Rule->Store || LooksIncompressible(Input, InputSize);
+			// the dictionary stands in for the context a small text file lacks at its start
+			Primed = !Stored && Dictionary && Entry && LooksLikeText(Input, InputSize);
+			if(!Stored)
+			{
+				OutputSize = OutputCapacity;
+				Result = CompressChunk(Context, Rule->Level, Rule->Strategy, Output, &OutputSize, Input, InputSize,
+					Primed ? (const Bytef*)Dictionary->data() : NULL, Primed ? Dictionary->length() : 0);
+				// grew beyond compressBound with an odd strategy
+				if(Result == Z_BUF_ERROR)
+				{
+					Result = Z_OK;
+					Stored = true;
+				}
+				// not worth an inflate on every install if less than 3% are saved
+				if(Result == Z_OK && OutputSize >= (uLongf)(InputSize - InputSize / 32))
+					Stored = true;
+				if(Stored)
+					Primed = false;
+			}
+			// the writer does not read the view, a stored chunk is taken out of it here
+			if(Stored && View)
+			{
+				memcpy(Output, Input, InputSize);
+				Input = Output;
+			}
+		}
+		__except(FilterPageError(GetExceptionCode()))
+		{
+			Result = Z_ERRNO;
+		}
+		QueryPerformanceCounter(&End);
+		Ticks = End.QuadPart - Start.QuadPart;
+		SetEvent(Done);
+	}
+};
+
+// Chunks are compressed independently, so they can be spread over all cores as long as
+// they are written back in the order they were read. The output is identical to compressing
+// them one after another. The offsets are counted from Position, the output need not be able
+// to tell its own.
+class CCompressPipeline
+{
+public:
+	CCompressPipeline(FileType File, __int64 Position, int ChunkSize, const std::string &Dictionary, const std::string &Root) : mPool(GetWorkerThreadCount())
+	{
+		mRoot = Root;
+		mFile = File;
+		mPosition = Position;
+		mChunkSize = ChunkSize;
+		mDictionary = Dictionary;
+		mFailed = 0;
+		mCompressError = false;
+		mInputError = false;
+		mReadError = false;
+		mNextSlot = 0;
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		mGranularity = si.dwAllocationGranularity;
+		uLongf OutputCapacity = compressBound(ChunkSize);
+		int NumSlots = GetPipelineSlots(mPool.GetNumThreads(), ChunkSize + OutputCapacity);
+		for(int i = 0; i < NumSlots; i++)
+		{
+			CompressSlot *s = new CompressSlot;
+			s->Buffer = new unsigned char[ChunkSize];
+			s->View = NULL;
+			s->Output = new unsigned char[OutputCapacity];
+			s->OutputCapacity = OutputCapacity;
+			s->Dictionary = mDictionary.empty() ? NULL : &mDictionary;
+			s->Done = CreateEvent(NULL, FALSE, FALSE, NULL);
+			mSlots.push_back(s);
+		}
+		mFree = CreateSemaphore(NULL, NumSlots, NumSlots, NULL);
+		mWriter = (HANDLE)_beginthreadex(NULL, 0, WriterProc, this, 0, NULL);
+	}
+	~CCompressPipeline()
+	{
+		if(mWriter)
+		{
+			Finish();
+			CloseHandle(mWriter);
+		}
+		CloseHandle(mFree);
+		for(std::vector<CompressSlot*>::iterator i = mSlots.begin(); i != mSlots.end(); i++)
+		{
+			CloseHandle((*i)->Done);
+			delete [] (*i)->Buffer;
+			delete [] (*i)->Output;
+			delete (*i);
+		}
+	}
+
+	// Chunks are compressed straight out of a view of the file, so the data is neither copied
+	// through stdio nor into the slot. Files that cannot be mapped are read into the slot.
+	bool AddFile(FileEntry *Entry)
+	{
+		HANDLE File = CreateFile(GetPath(Entry).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if(File == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER Size;
+		if(!GetFileSizeEx(File, &Size))
+		{
+			CloseHandle(File);
+			return false;
+		}
+		Entry->DataSize = Size.QuadPart;
+
+		// empty files cannot be mapped, they still get one (empty) chunk
+		HANDLE Mapping = Entry->DataSize > 0 ? CreateFileMapping(File, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+		PackRule *Rule = FindPackRule(Entry, mRoot);
+		bool Hashing = !Entry->Hash.Valid && mHasher.Begin();
+		bool Result = true;
+		__int64 Offset = 0;
+		bool First = true;
+		while(First || Offset < Entry->DataSize)
+		{
+			if(mFailed)
+			{
+				Result = false;
+				break;
+			}
+			CompressSlot *s = AcquireSlot();
+			s->Entry = First ? Entry : NULL;
+			s->NumFiles = First ? 1 : 0;
+			s->Last = false;
+			s->Reused = false;
+			s->Rule = Rule;
+			s->InputSize = Entry->DataSize - Offset < mChunkSize ? (int)(Entry->DataSize - Offset) : mChunkSize;
+			s->Input = Mapping ? MapChunk(s, Mapping, Offset) : NULL;
+			if(!s->Input)
+			{
+				s->Input = s->Buffer;
+				LARGE_INTEGER Position;
+				Position.QuadPart = Offset;
+				DWORD r = 0;
+				if(s->InputSize > 0 && (!SetFilePointerEx(File, Position, NULL, FILE_BEGIN) || !ReadFile(File, s->Input, s->InputSize, &r, NULL)))
+					r = 0;
+				// shrunk while packing
+				if(r < (DWORD)s->InputSize)
+				{
+					s->InputSize = r;
+					Entry->DataSize = Offset + r;
+				}
+			}
+			if(Hashing && !mHasher.UpdateView(s->Input, s->InputSize))
+			{
+				// the view could not be read after all
+				mInputError = true;
+				InterlockedExchange(&mFailed, 1);
+				SetEvent(s->Done);
+				Hashing = false;
+				Result = false;
+				break;
+			}
+			mPool.Submit(s);
+			First = false;
+			Offset += s->InputSize;
+		}
+
+		if(Mapping)
+			CloseHandle(Mapping);
+		CloseHandle(File);
+		if(Hashing)
+			mHasher.End(Entry->Hash);
+		return Result;
+	}
+
+	// packs data that only exists in memory, like a delta or a solid block of NumFiles files
+	bool AddBuffer(FileEntry *Entry, const unsigned char *Data, __int64 Size, int NumFiles)
+	{
+		Entry->DataSize = Size;
+		PackRule *Rule = FindPackRule(Entry, mRoot);
+		__int64 Offset = 0;
+		bool First = true;
+		while(First || Offset < Size)
+		{
+			if(mFailed)
+				return false;
+			CompressSlot *s = AcquireSlot();
+			s->Entry = First ? Entry : NULL;
+			s->NumFiles = First ? NumFiles : 0;
+			s->Last = false;
+			s->Reused = false;
+			s->Rule = Rule;
+			s->InputSize = Size - Offset < mChunkSize ? (int)(Size - Offset) : mChunkSize;
+			s->Input = s->Buffer;
+			memcpy(s->Input, Data + Offset, s->InputSize);
+			mPool.Submit(s);
+			First = false;
+			Offset += s->InputSize;
+		}
+		return true;
+	}
+
+	// copies the chunks of an unchanged file from the previous package as they are
+	bool AddPackedFile(FileEntry *Entry, FileType Source, __int64 Offset)
+	{
+		if(Seek(Source, Offset, SEEK_SET) < 0)
+			return ReadFailed(NULL);
+
+		__int64 Remaining = Entry->DataSize;
+		bool First = true;
+		while(First || Remaining > 0)
+		{
+			if(mFailed)
+				return false;
+			uLongf compsize = 0;
+			int uncompsize = 0;
+			Read(Source, &compsize, sizeof(uLongf));
+			bool Stored = (compsize & CHUNK_STORED) != 0;
+			bool Primed = (compsize & CHUNK_DICTIONARY) != 0;	// with the same dictionary, the packer takes it over
+			compsize &= ~(CHUNK_STORED | CHUNK_DICTIONARY);
+			if(Read(Source, &uncompsize, sizeof(int)) != sizeof(int) || uncompsize < 0 || uncompsize > Remaining || uncompsize > mChunkSize || (uncompsize == 0 && Remaining > 0) || (Stored ? compsize != uncompsize : compsize > mSlots[0]->OutputCapacity))
+				return ReadFailed(NULL);
+
+			CompressSlot *s = AcquireSlot();
+			s->Entry = First ? Entry : NULL;
+			s->NumFiles = First ? 1 : 0;
+			s->Last = false;
+			s->Reused = true;
+			s->Rule = NULL;
+			s->Stored = Stored;
+			s->Primed = Primed;
+			s->Result = Z_OK;
+			s->InputSize = uncompsize;
+			s->OutputSize = compsize;
+			s->Input = s->Buffer;
+			if(Read(Source, Stored ? s->Input : s->Output, compsize) != compsize)
+				return ReadFailed(s);
+			SetEvent(s->Done);
+			First = false;
+			Remaining -= uncompsize;
+		}
+		return true;
+	}
+
+	// where the next chunk would go
+	__int64 GetPosition() const
+	{
+		return mPosition;
+	}
+
+	bool Finish()
+	{
+		if(!mWriter)
+			return false;
+		CompressSlot *s = AcquireSlot();
+		s->Last = true;
+		SetEvent(s->Done);
+		WaitPumping(mWriter);
+		CloseHandle(mWriter);
+		mWriter = NULL;
+		if(mCompressError)
+			ShowError("Error while compressing input data", "Fatal error");
+		if(mInputError)
+			ShowError("Error while reading the files to pack", "Fatal error");
+		if(mReadError)
+			ShowError("Error while reading the previous package, rebuild it with -full", "Fatal error");
+		return !mFailed;
+	}
+
+private:
+	// the writer skips everything once the pipeline has failed, so an acquired slot can be handed on as it is
+	bool ReadFailed(CompressSlot *s)
+	{
+		mReadError = true;
+		InterlockedExchange(&mFailed, 1);
+		if(s)
+			SetEvent(s->Done);
+		return false;
+	}
+
+	// Views have to start at a multiple of the allocation granularity, chunks need not. The
+	// chunk is read in here, if that fails it is read with ReadFile instead.
+	unsigned char *MapChunk(CompressSlot *s, HANDLE Mapping, __int64 Offset)
+	{
+		__int64 Start = Offset - Offset % mGranularity;
+		s->View = MapViewOfFile(Mapping, FILE_MAP_READ, (DWORD)(Start >> 32), (DWORD)Start, (SIZE_T)(Offset - Start + s->InputSize));
+		if(!s->View)
+			return NULL;
+		unsigned char *Data = (unsigned char*)s->View + (Offset - Start);
+		if(!TouchView(Data, s->InputSize))
+		{
+			UnmapViewOfFile(s->View);
+			s->View = NULL;
+			return NULL;
+		}
+		return Data;
+	}
+
+	CompressSlot *AcquireSlot()
+	{
+		WaitPumping(mFree);
+		CompressSlot *s = mSlots[mNextSlot];
+		mNextSlot = (mNextSlot + 1) % mSlots.size();
+		return s;
+	}
+
+	static unsigned __stdcall WriterProc(void *Param)
+	{
+		CCompressPipeline *p = reinterpret_cast<CCompressPipeline*>(Param);
+		for(unsigned int n = 0;; n = (n + 1) % p->mSlots.size())
+		{
+			CompressSlot *s = p->mSlots[n];
+			WaitForSingleObject(s->Done, INFINITE);
+			if(s->Last)
+				break;
+			if(!p->mFailed)
+			{
+				if(s->Result != Z_OK)
+				{
+					// Z_ERRNO only comes from a view that could not be read
+					if(s->Result == Z_ERRNO)
+						p->mInputError = true;
+					else
+						p->mCompressError = true;
+					InterlockedExchange(&p->mFailed, 1);
+				} else
+				{
+					if(s->Entry)
+						s->Entry->DataOffset = p->mPosition;
+					uLongf Size = s->Stored ? s->InputSize : s->OutputSize;
+					uLongf Header = s->Stored ? (Size | CHUNK_STORED) : s->Primed ? (Size | CHUNK_DICTIONARY) : Size;
+					Write(p->mFile, &Header, sizeof(uLongf));			// compressed size
+					Write(p->mFile, &s->InputSize, sizeof(int));		// uncompressed size
+					int w = Write(p->mFile, s->Stored ? s->Input : s->Output, Size);
+					if(w != Size)
+						InterlockedExchange(&p->mFailed, 1);
+					p->mPosition += sizeof(uLongf) + sizeof(int) + Size;
+					if(s->Primed)
+						NumDictionaryChunks++;
+
+					if(s->Reused)
+					{
+						NumReusedFiles += s->NumFiles;
+						ReusedBytes += s->InputSize;
+					} else
+					{
+						s->Rule->NumFiles += s->NumFiles;
+						s->Rule->InputBytes += s->InputSize;
+						s->Rule->OutputBytes += Size;
+						s->Rule->Ticks += s->Ticks;
+					}
+				}
+			}
+			if(s->View)
+			{
+				UnmapViewOfFile(s->View);
+				s->View = NULL;
+			}
+			ReleaseSemaphore(p->mFree, 1, NULL);
+		}
+		return 0;
+	}
+
+	CWorkerPool mPool;
+	FileType mFile;
+	__int64 mPosition;
+	int mChunkSize;
+	DWORD mGranularity;
+	std::string mDictionary;
+	std::string mRoot;		// of the mod, pack rules match the paths inside it
+	std::vector<CompressSlot*> mSlots;
+	unsigned int mNextSlot;
+	HANDLE mFree;		// counts the slots not in flight
+	HANDLE mWriter;
+	volatile LONG mFailed;
+	bool mCompressError;
+	bool mInputError;		// a file to pack could not be read
+	bool mReadError;
+	CContentHasher mHasher;
+};
+
+bool LoadFile(const std::string &Path, std::vector<unsigned char> &Data)
+{
+	FILE* input = fopen(Path.c_str(), "rb");
+	if(!input)
+		return false;
+	_fseeki64(input, 0, SEEK_END);
+	Data.resize((size_t)_ftelli64(input));
+	_fseeki64(input, 0, SEEK_SET);
+	bool Result = Data.empty() || fread(&Data[0], 1, Data.size(), input) == Data.size();
+	fclose(input);
+	return Result;
+}
+
+// maps an entry to the earlier one whose data it shares
+typedef std::map<FileEntry*, FileEntry*> DuplicateMap;
+
+// in the order CopyFolder stores them
+void CollectFiles(ModContents *Node, std::vector<FileEntry*> &Files)
+{
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+		Files.push_back(&*i);
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+		CollectFiles(*i, Files);
+}
+
+// Mods tend to ship the same texture or sound in several folders. Only files whose size
+// matches another one are hashed, the first copy is stored and the others point to it.
+void FindDuplicates(ModContents *Node, DuplicateMap &Duplicates)
+{
+	NumDuplicateFiles = 0;
+	DuplicateBytes = 0.0;
+
+	std::vector<FileEntry*> Files;
+	CollectFiles(Node, Files);
+
+	std::map<__int64, std::vector<FileEntry*> > BySize;
+	for(std::vector<FileEntry*>::iterator i = Files.begin(); i != Files.end(); i++)
+	{
+		if((*i)->DataSize > 0)
+			BySize[(*i)->DataSize].push_back(*i);
+	}
+
+	CContentHasher Hasher;
+	for(std::map<__int64, std::vector<FileEntry*> >::iterator i = BySize.begin(); i != BySize.end(); i++)
+	{
+		if(i->second.size() < 2)
+			continue;
+		std::map<ContentHash, FileEntry*> ByHash;
+		for(std::vector<FileEntry*>::iterator j = i->second.begin(); j != i->second.end(); j++)
+		{
+			PumpMessages();
+			if(!(*j)->Hash.Valid && !Hasher.HashFile(GetPath(*j), (*j)->Hash))
+				continue;
+			const ContentHash &Digest = (*j)->Hash;
+			std::map<ContentHash, FileEntry*>::iterator First = ByHash.find(Digest);
+			if(First == ByHash.end())
+			{
+				ByHash[Digest] = *j;
+				continue;
+			}
+			Duplicates[*j] = First->second;
+			NumDuplicateFiles++;
+			DuplicateBytes += double(i->first);
+		}
+	}
+}
+
+inline unsigned int HashGram(const unsigned char *p)
+{
+	unsigned int a, b;
+	memcpy(&a, p, 4);
+	memcpy(&b, p + 4, 4);
+	return (a * 2654435761u ^ b * 2246822519u) >> (32 - DICTIONARY_HASHBITS);
+}
+
+// sum over the grams of a segment that other files share
+unsigned int ScoreSegment(const unsigned char *Data, int Size, const std::vector<unsigned int> &Counts)
+{
+	unsigned int Score = 0;
+	for(int i = 0; i + DICTIONARY_GRAM <= Size; i++)
+	{
+		unsigned int Count = Counts[HashGram(Data + i)];
+		if(Count > 1)
+			Score += Count - 1;
+	}
+	return Score;
+}
+
+// Builds the preset dictionary from the text files of the mod: every 64 byte segment is scored
+// by how many files share its 8 byte grams, the best ones are taken greedily and the grams they
+// cover stop counting, so the dictionary does not fill up with variants of one line. Deflate
+// reaches the end of the dictionary cheapest, so the best segments go there.
+void BuildDictionary(ModContents *Node, std::string &Dictionary)
+{
+	Dictionary.clear();
+	std::vector<FileEntry*> Files;
+	CollectFiles(Node, Files);
+
+	std::vector<std::vector<unsigned char> > Samples;
+	size_t SampleSize = 0;
+	for(std::vector<FileEntry*>::iterator i = Files.begin(); i != Files.end() && SampleSize < DICTIONARY_SAMPLE; i++)
+	{
+		PumpMessages();
+		if((*i)->DataSize < DICTIONARY_SEGMENT || (*i)->DataSize > DICTIONARY_MAXFILESIZE)
+			continue;
+		std::vector<unsigned char> Data;
+		if(!LoadFile(GetPath(*i), Data) || Data.size() < DICTIONARY_SEGMENT || !LooksLikeText(&Data[0], Data.size()))
+			continue;
+		SampleSize += Data.size();
+		Samples.push_back(std::vector<unsigned char>());
+		Samples.back().swap(Data);
+	}
+	if(Samples.size() < 2)
+		return;
+
+	// a gram counts once per file, repeats inside one file deflate finds by itself
+	std::vector<unsigned int> Counts(1 << DICTIONARY_HASHBITS, 0);
+	std::vector<unsigned int> LastSample(1 << DICTIONARY_HASHBITS, (unsigned int)-1);
+	for(unsigned int i = 0; i < Samples.size(); i++)
+	{
+		const std::vector<unsigned char> &Data = Samples[i];
+		for(size_t j = 0; j + DICTIONARY_GRAM <= Data.size(); j++)
+		{
+			unsigned int h = HashGram(&Data[j]);
+			if(LastSample[h] != i)
+			{
+				LastSample[h] = i;
+				Counts[h]++;
+			}
+		}
+	}
+
+	std::vector<std::pair<const unsigned char*, int> > Segments;
+	std::priority_queue<std::pair<unsigned int, unsigned int> > Queue;	// score, segment
+	for(unsigned int i = 0; i < Samples.size(); i++)
+	{
+		const std::vector<unsigned char> &Data = Samples[i];
+		for(size_t j = 0; j < Data.size(); j += DICTIONARY_SEGMENT)
+		{
+			int Size = Data.size() - j < DICTIONARY_SEGMENT ? (int)(Data.size() - j) : DICTIONARY_SEGMENT;
+			unsigned int Score = ScoreSegment(&Data[j], Size, Counts);
+			if(Score == 0)
+				continue;
+			Queue.push(std::make_pair(Score, (unsigned int)Segments.size()));
+			Segments.push_back(std::make_pair(&Data[j], Size));
+		}
+	}
+
+	// scores only drop, so a segment that still beats the next best one after rescoring is the best
+	std::vector<unsigned int> Chosen;
+	int Size = 0;
+	while(!Queue.empty() && Size < DICTIONARY_SIZE)
+	{
+		std::pair<unsigned int, unsigned int> Top = Queue.top();
+		Queue.pop();
+		const std::pair<const unsigned char*, int> &Segment = Segments[Top.second];
+		unsigned int Score = ScoreSegment(Segment.first, Segment.second, Counts);
+		if(Score == 0)
+			continue;
+		if(!Queue.empty() && Score < Queue.top().first)
+		{
+			Queue.push(std::make_pair(Score, Top.second));
+			continue;
+		}
+		Chosen.push_back(Top.second);
+		Size += Segment.second;
+		for(int i = 0; i + DICTIONARY_GRAM <= Segment.second; i++)
+			Counts[HashGram(Segment.first + i)] = 0;
+	}
+
+	for(std::vector<unsigned int>::reverse_iterator i = Chosen.rbegin(); i != Chosen.rend(); i++)
+		Dictionary.append((const char*)Segments[*i].first, Segments[*i].second);
+	if(Dictionary.length() > DICTIONARY_SIZE)
+		Dictionary.erase(0, Dictionary.length() - DICTIONARY_SIZE);
+}
+
+// follows the chunk size since 0x00000108: size, and unless it is 0 the deflated size and data,
+// returns the number of bytes written
+int WriteDictionary(FileType File, const std::string &Dictionary)
+{
+	int Size = Dictionary.length();
+	Write(File, &Size, sizeof(int));
+	if(Size == 0)
+		return sizeof(int);
+	static Bytef Packed[DICTIONARY_SIZE + DICTIONARY_SIZE / 512 + 64];
+	uLongf PackedSize = sizeof(Packed);
+	compress2(Packed, &PackedSize, (const Bytef*)Dictionary.data(), Size, Z_BEST_COMPRESSION);
+	Write(File, &PackedSize, sizeof(uLongf));
+	Write(File, Packed, PackedSize);
+	return sizeof(int) + sizeof(uLongf) + PackedSize;
+}
+
+// The directory of the package a repack replaces. Files that did not change since are
+// copied from it chunk by chunk instead of being compressed again.
+class CPreviousPackage
+{
+public:
+	CPreviousPackage()
+	{
+		mFile = NULL;
+	}
+	~CPreviousPackage()
+	{
+		Unload();
+	}
+
+	// older packages know neither write times nor hashes, and copied chunks must have the new
+	// size, since the installer tells single chunk files by their size
+	bool Load(const std::string &Path, int ChunkSize)
+	{
+		mFile = Open(Path.c_str(), "rb");
+		if(!mFile)
+			return false;
+
+		ModPackageHeader h;
+		memset(&h, 0, sizeof(h));
+		Read(mFile, h.ID, 5);
+		Read(mFile, &h.Version, sizeof(int));
+		Read(mFile, &h.ChunkSize, sizeof(int));
+		if(memcmp(h.ID, "E4MP", 5) || h.Version < 0x00000106 || h.Version > FILEVERSION || h.ChunkSize != ChunkSize)
+			return false;
+		if(!ReadDictionary(mFile, h.Version, mDictionary) || !ReadPackageContents(mFile, h.Version, mContents))
+			return false;
+
+		mIndex.Build(&mContents);
+		return true;
+	}
+
+	void Unload()
+	{
+		if(mFile)
+			Close(mFile);
+		mFile = NULL;
+		mIndex.Clear();
+		FreeFolder(&mContents);
+		mDictionary.clear();
+	}
+
+	// chunks copied from the package may have been primed with it
+	const std::string &GetDictionary() const
+	{
+		return mDictionary;
+	}
+
+	const FileEntry *Find(const std::string &Path) const
+	{
+		return mIndex.FindFile(Path);
+	}
+
+	FileType GetFile() const
+	{
+		return mFile;
+	}
+
+private:
+	FileType mFile;
+	ModContents mContents;
+	CPathIndex mIndex;
+	std::string mDictionary;
+};
+
+// maps an entry to its data in the previous package
+typedef std::map<FileEntry*, const FileEntry*> UnchangedMap;
+
+// A file is unchanged if its size and write time match. If only the time differs (a checkout,
+// a copy) the contents are compared by hash. Files of a solid block have no chunks of their
+// own to copy, they are packed again.
+void FindUnchanged(ModContents *Node, const std::string &Prefix, CPreviousPackage &Previous, CContentHasher &Hasher, UnchangedMap &Unchanged)
+{
+	PumpMessages();
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	{
+		const FileEntry *p = Previous.Find(Prefix + GetName(&*i));
+		if(!p || p->SolidOffset >= 0 || i->DataSize != p->DataSize)
+			continue;
+		if(i->WriteTime != p->WriteTime)
+		{
+			ContentHash Digest;
+			if(!Hasher.HashFile(GetPath(&*i), Digest) || Digest != p->Hash)
+				continue;
+		}
+		i->DataSize = p->DataSize;
+		i->Hash = p->Hash;
+		Unchanged[&*i] = p;
+	}
+
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+		FindUnchanged(*i, Prefix + (*i)->Name + "\\", Previous, Hasher, Unchanged);
+}
+
+// Reads the files the packer takes next, so they are in the file cache by the time they are
+// mapped. The disk keeps streaming while the packer compresses, instead of waiting for every
+// open and seek in turn, which is what makes packing from disks and shares slow.
+class CPrefetcher
+{
+public:
+	CPrefetcher(const std::vector<FileEntry*> &Files)
+	{
+		mFiles = Files;
+		mConsumed = 0;
+		mStop = 0;
+		mAdvanced = CreateEvent(NULL, FALSE, FALSE, NULL);
+		mThread = (HANDLE)_beginthreadex(NULL, 0, ThreadProc, this, 0, NULL);
+	}
+	~CPrefetcher()
+	{
+		InterlockedExchange(&mStop, 1);
+		SetEvent(mAdvanced);
+		WaitForSingleObject(mThread, INFINITE);
+		CloseHandle(mThread);
+		CloseHandle(mAdvanced);
+	}
+
+	// the packer is done with the next file of the list
+	void Advance()
+	{
+		InterlockedIncrement(&mConsumed);
+		SetEvent(mAdvanced);
+	}
+
+private:
+	static unsigned __stdcall ThreadProc(void *Param)
+	{
+		CPrefetcher *p = reinterpret_cast<CPrefetcher*>(Param);
+		unsigned char *Buffer = new unsigned char[PREFETCH_BLOCKSIZE];
+		std::vector<__int64> Sizes;		// bytes read of each file
+		unsigned int Released = 0;		// files the packer has taken, their bytes no longer count
+		__int64 Ahead = 0;
+		for(unsigned int i = 0; i < p->mFiles.size() && !p->mStop; i++)
+		{
+			// the file the packer is at is left to it
+			bool Skip = false;
+			for(;;)
+			{
+				unsigned int Consumed = p->mConsumed;
+				for(; Released < Consumed && Released < Sizes.size(); Released++)
+					Ahead -= Sizes[Released];
+				Skip = p->mStop || Consumed >= i;
+				if(Skip || (i - Consumed < PREFETCH_FILES && Ahead < PREFETCH_MEMORY))
+					break;
+				WaitForSingleObject(p->mAdvanced, INFINITE);
+			}
+
+			__int64 Done = 0;
+			HANDLE File = Skip ? INVALID_HANDLE_VALUE : CreateFile(GetPath(p->mFiles[i]).c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+			if(File != INVALID_HANDLE_VALUE)
+			{
+				// a file larger than what is left of the budget is only read in part
+				__int64 Limit = PREFETCH_MEMORY - Ahead;
+				DWORD r = 0;
+				while(Done < Limit && !p->mStop && (unsigned int)p->mConsumed < i && ReadFile(File, Buffer, PREFETCH_BLOCKSIZE, &r, NULL) && r > 0)
+					Done += r;
+				CloseHandle(File);
+			}
+			Sizes.push_back(Done);
+			Ahead += Done;
+		}
+		delete [] Buffer;
+		return 0;
+	}
+
+	std::vector<FileEntry*> mFiles;	// in the order the packer reads them
+	volatile LONG mConsumed;
+	volatile LONG mStop;
+	HANDLE mAdvanced;
+	HANDLE mThread;
+};
+
+// what CopyFolder does with each file besides compressing it
+struct PackPlan
+{
+	DuplicateMap Duplicates;
+	UnchangedMap Unchanged;
+	std::set<FileEntry*> Solid;		// packed into solid blocks after the other files
+	CPreviousPackage *Previous;
+	CPrefetcher *Prefetch;
+	std::string Root;		// the mod folder
+};
+
+// small files with the same rule and extension, in directory order
+typedef std::map<std::pair<PackRule*, std::string>, std::vector<FileEntry*> > SolidGroupMap;
+
+// Every chunk starts with an empty deflate window, so a file of a few KB compresses badly on
+// its own and costs a chunk header and a job. Similar small files are concatenated instead,
+// the ones that fit a block of BlockSize.
+void FindSolidFiles(ModContents *Node, PackPlan &Plan, int BlockSize, SolidGroupMap &Groups)
+{
+	int MaxFileSize = BlockSize < SOLID_MAXFILESIZE ? BlockSize : SOLID_MAXFILESIZE;
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	{
+		if(Plan.Duplicates.find(&*i) != Plan.Duplicates.end() || Plan.Unchanged.find(&*i) != Plan.Unchanged.end())
+			continue;
+		PackRule *Rule = FindPackRule(&*i, Plan.Root);
+		if(!Rule || Rule->Store || i->DataSize > MaxFileSize)
+			continue;
+
+		const char *Dot = strrchr(GetName(&*i), '.');
+		std::string Extension = FoldPath(Dot ? Dot : "");
+		Groups[std::make_pair(Rule, Extension)].push_back(&*i);
+		Plan.Solid.insert(&*i);
+	}
+
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+		FindSolidFiles(*i, Plan, BlockSize, Groups);
+}
+
+// one chunk holding several files, the entry only carries the name the rule is matched against
+struct SolidBlock
+{
+	FileEntry Entry;
+	std::vector<FileEntry*> Files;
+};
+
+bool AddSolidBlock(CCompressPipeline &Pipeline, std::list<SolidBlock> &Blocks, std::vector<FileEntry*> &Files, std::vector<unsigned char> &Data)
+{
+	Blocks.push_back(SolidBlock());
+	SolidBlock &b = Blocks.back();
+	b.Entry = *Files[0];
+	b.Entry.Hash.Valid = false;
+	b.Files.swap(Files);
+	NumSolidFiles += b.Files.size();
+	NumSolidBlocks++;
+	bool Result = Pipeline.AddBuffer(&b.Entry, Data.empty() ? NULL : &Data[0], Data.size(), b.Files.size());
+	Data.clear();
+	return Result;
+}
+
+// the blocks never exceed a chunk, so each one is inflated in one go when installing
+bool PackSolidBlocks(CCompressPipeline &Pipeline, SolidGroupMap &Groups, int BlockSize, CPrefetcher &Prefetch, std::list<SolidBlock> &Blocks)
+{
+	CContentHasher Hasher;
+	for(SolidGroupMap::iterator i = Groups.begin(); i != Groups.end(); i++)
+	{
+		std::vector<unsigned char> Data, File;
+		std::vector<FileEntry*> Files;
+		for(std::vector<FileEntry*>::iterator j = i->second.begin(); j != i->second.end(); j++)
+		{
+			PumpMessages();
+			FileEntry *e = *j;
+			if(!LoadFile(GetPath(e), File))
+				return false;
+			Prefetch.Advance();
+			// it grew since it was chosen
+			if(File.size() > (size_t)BlockSize)
+			{
+				if(!Pipeline.AddFile(e))
+					return false;
+				continue;
+			}
+			if(Data.size() + File.size() > (size_t)BlockSize && !AddSolidBlock(Pipeline, Blocks, Files, Data))
+				return false;
+
+			e->SolidOffset = Data.size();
+			e->DataSize = File.size();
+			if(!e->Hash.Valid && Hasher.Begin())
+			{
+				if(!File.empty())
+					Hasher.Update(&File[0], File.size());
+				Hasher.End(e->Hash);
+			}
+			Data.insert(Data.end(), File.begin(), File.end());
+			Files.push_back(e);
+		}
+		if(!Files.empty() && !AddSolidBlock(Pipeline, Blocks, Files, Data))
+			return false;
+	}
+	return true;
+}
+
+bool CopyFolder(CCompressPipeline &Pipeline, ModContents *Node, const PackPlan &Plan)
+{
+	assert(Node);
+	PumpMessages();
+
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	{
+		if(Plan.Duplicates.find(&*i) != Plan.Duplicates.end() || Plan.Solid.find(&*i) != Plan.Solid.end())
+			continue;
+		UnchangedMap::const_iterator u = Plan.Unchanged.find(&*i);
+		if(u != Plan.Unchanged.end())
+		{
+			if(!Pipeline.AddPackedFile(&*i, Plan.Previous->GetFile(), u->second->DataOffset))
+				return false;
+			continue;
+		}
+		if(!Pipeline.AddFile(&*i))
+			return false;
+		Plan.Prefetch->Advance();
+	}
+
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	{
+		if(!CopyFolder(Pipeline, (*i), Plan))
+			return false;
+	}
+
+	return true;
+}
+
+// the source files CopyFolder and PackSolidBlocks read, in that order
+void CollectReadOrder(ModContents *Node, const PackPlan &Plan, std::vector<FileEntry*> &Files)
+{
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	{
+		if(Plan.Duplicates.find(&*i) == Plan.Duplicates.end() && Plan.Solid.find(&*i) == Plan.Solid.end() && Plan.Unchanged.find(&*i) == Plan.Unchanged.end())
+			Files.push_back(&*i);
+	}
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+		CollectReadOrder(*i, Plan, Files);
+}
+
+// Position is where the data starts, and where it ends afterwards
+bool CopyFiles(FileType File, __int64 &Position, ModContents *Node, int ChunkSize, const std::string &Dictionary, CPreviousPackage *Previous)
+{
+	assert(File);
+	assert(Node);
+
+	NumReusedFiles = 0;
+	ReusedBytes = 0.0;
+	PackPlan Plan;
+	Plan.Previous = Previous;
+	Plan.Root = Node->Path;
+	if(Previous)
+	{
+		CContentHasher Hasher;
+		FindUnchanged(Node, "", *Previous, Hasher, Plan.Unchanged);
+	}
+	FindDuplicates(Node, Plan.Duplicates);
+	NumSolidFiles = 0;
+	NumSolidBlocks = 0;
+	SolidGroupMap Groups;
+	int BlockSize = SolidBlockSize < ChunkSize ? SolidBlockSize : ChunkSize;
+	if(BlockSize > 0)
+		FindSolidFiles(Node, Plan, BlockSize, Groups);
+
+	std::vector<FileEntry*> ReadOrder;
+	CollectReadOrder(Node, Plan, ReadOrder);
+	for(SolidGroupMap::iterator i = Groups.begin(); i != Groups.end(); i++)
+		ReadOrder.insert(ReadOrder.end(), i->second.begin(), i->second.end());
+	CPrefetcher Prefetch(ReadOrder);
+	Plan.Prefetch = &Prefetch;
+
+	NumDictionaryChunks = 0;
+	DictionarySize = Dictionary.length();
+	CCompressPipeline Pipeline(File, Position, ChunkSize, Dictionary, Node->Path);
+	std::list<SolidBlock> Blocks;
+	bool Result = CopyFolder(Pipeline, Node, Plan) && PackSolidBlocks(Pipeline, Groups, BlockSize, Prefetch, Blocks);
+	if(!Pipeline.Finish())
+		return false;
+	Position = Pipeline.GetPosition();
+
+	for(std::list<SolidBlock>::iterator i = Blocks.begin(); i != Blocks.end(); i++)
+	{
+		for(std::vector<FileEntry*>::iterator j = i->Files.begin(); j != i->Files.end(); j++)
+			(*j)->DataOffset = i->Entry.DataOffset;
+	}
+	for(DuplicateMap::iterator i = Plan.Duplicates.begin(); i != Plan.Duplicates.end(); i++)
+	{
+		i->first->DataOffset = i->second->DataOffset;
+		i->first->DataSize = i->second->DataSize;
+		i->first->SolidOffset = i->second->SolidOffset;
+		i->first->Hash = i->second->Hash;
+	}
+	return Result;
+}
+
+// 20 bytes, zeros if the file could not be hashed
+void WriteHash(FileType File, const ContentHash &Hash)
+{
+	static const unsigned char NoHash[20] = { 0 };
+	Write(File, Hash.Valid ? Hash.Value : NoHash, 20);
+}
+
+// returns the number of bytes written
+int WritePackageInfo(FileType File, ModContents *Node)
+{
+	assert(File);
+	assert(Node);
+	int l = Node->Name.length()+1;
+	Write(File, &l, sizeof(int));
+	Write(File, Node->Name.c_str(), l);
+	int Size = sizeof(int) + l;
+	
+	int NumFolders = Node->SubFolders.size();
+	Write(File, &NumFolders, sizeof(int));
+	Size += sizeof(int);
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	{
+		int l = (*i)->Name.length()+1;
+		Write(File, &l, sizeof(int));
+		Write(File, (*i)->Name.c_str(), l);
+		Size += sizeof(int) + l;
+	}
+	int NumFiles = Node->Files.size();
+	Write(File, &NumFiles, sizeof(int));
+	Size += sizeof(int);
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	{
+		const char *Name = GetName(&*i);
+		int l = strlen(Name)+1;
+		Write(File, &l, sizeof(int));
+		Write(File, Name, l);
+		Write(File, &i->DataOffset, sizeof(__int64));
+		Write(File, &i->DataSize, sizeof(__int64));
+		Write(File, &i->WriteTime, sizeof(__int64));
+		WriteHash(File, i->Hash);
+		Write(File, &i->SolidOffset, sizeof(int));
+		Size += sizeof(int) + l + 3 * sizeof(__int64) + 20 + sizeof(int);
+	}
+
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+		Size += WritePackageInfo(File, *i);
+	return Size;
+}
+
+// the footer locates the directory
+bool WritePackageFooter(FileType File, __int64 DirectoryOffset, int DirectorySize)
+{
+	ModPackageFooter Footer;
+	Footer.DirectoryOffset = DirectoryOffset;
+	Footer.DirectorySize = DirectorySize;
+	strcpy(Footer.ID, "E4MD");
+	Write(File, &Footer.DirectoryOffset, sizeof(__int64));
+	Write(File, &Footer.DirectorySize, sizeof(int));
+	return Write(File, Footer.ID, 5) == 5;
+}
+
+enum UnpackError
+{
+	UNPACK_OK,
+	UNPACK_CORRUPT,
+	UNPACK_DECOMPRESS,
+	UNPACK_WRITE
+};
+
+// output file shared by all chunks of one entry, closed by whichever chunk finishes last
+struct UnpackTarget
+{
+	FileEntry *Entry;
+	int Index;			// position in the file list, decides which error gets reported
+	HANDLE Out;			// NULL until opened, single chunk files are opened by their worker
+	volatile LONG Pending;
+	volatile LONG Error;	// set through SetError only
+};
+
+// the reader and several workers may fail on the same file, the first error is kept
+void SetError(UnpackTarget *t, LONG Error)
+{
+	InterlockedCompareExchange(&t->Error, Error, UNPACK_OK);
+}
+
+struct DecompressSlot : public CWorkerJob
+{
+	class CDecompressPipeline *Pipeline;
+	UnpackTarget *Target;
+	unsigned char *Input;
+	uLongf InputSize;
+	bool Stored;
+	int OutputSize;
+	__int64 Offset;		// position of the chunk in the output file
+	std::vector<UnpackTarget*> Block;	// all files of a solid block, Target is not used then
+
+	void Run(WorkerContext *Context);
+	void RunBlock(WorkerContext *Context);
+};
+
+// Every chunk is an independent deflate stream with a known uncompressed size. The package
+// is read sequentially by the calling thread while the workers inflate the chunks of any
+// number of files and write them straight to their offsets, so neither one big file nor
+// the open/close latency of many small ones serializes the install.
+class CDecompressPipeline
+{
+public:
+	CDecompressPipeline(int MaxChunkSize, const std::string &Dictionary) : mPool(GetWorkerThreadCount())
+	{
+		mMaxChunkSize = MaxChunkSize;
+		mDictionary = Dictionary;
+		mInputCapacity = compressBound(MaxChunkSize);
+		InitializeCriticalSection(&mLock);
+		int NumSlots = GetPipelineSlots(mPool.GetNumThreads(), mInputCapacity);
+		for(int i = 0; i < NumSlots; i++)
+		{
+			DecompressSlot *s = new DecompressSlot;
+			s->Pipeline = this;
+			s->Input = new unsigned char[mInputCapacity];
+			mSlots.push_back(s);
+		}
+		mFreeSlots = mSlots;
+		mFree = CreateSemaphore(NULL, NumSlots, NumSlots, NULL);
+		mFailed = 0;
+		mErrorIndex = -1;
+		mError = UNPACK_OK;
+	}
+	~CDecompressPipeline()
+	{
+		WaitIdle();
+		CloseHandle(mFree);
+		for(std::vector<DecompressSlot*>::iterator i = mSlots.begin(); i != mSlots.end(); i++)
+		{
+			delete [] (*i)->Input;
+			delete (*i);
+		}
+		DeleteCriticalSection(&mLock);
+	}
+
+	bool HasFailed() const
+	{
+		return mFailed != 0;
+	}
+
+	int GetMaxChunkSize() const
+	{
+		return mMaxChunkSize;
+	}
+
+	const std::string &GetDictionary() const
+	{
+		return mDictionary;
+	}
+
+	// reads the chunks of one entry from the current position, returns the number of bytes consumed
+	__int64 UnpackFile(FileType f, FileEntry *e, int Index)
+	{
+		UnpackTarget *Target = new UnpackTarget;
+		Target->Entry = e;
+		Target->Index = Index;
+		Target->Out = NULL;
+		Target->Pending = 1;
+		Target->Error = UNPACK_OK;
+
+		__int64 todo = e->DataSize;
+		__int64 Offset = 0;
+		__int64 Consumed = 0;
+		do
+		{
+			uLongf compsize = 0;
+			int uncompsize = 0;
+			Read(f, &compsize, sizeof(uLongf));
+			bool Stored = (compsize & CHUNK_STORED) != 0;	// never set before 0x102, too large for a real size
+			compsize &= ~(CHUNK_STORED | CHUNK_DICTIONARY);	// a primed chunk asks for the dictionary by itself
+			if(Read(f, &uncompsize, sizeof(int)) != sizeof(int) || compsize > mInputCapacity || uncompsize < 0 || uncompsize > todo || uncompsize > mMaxChunkSize || (uncompsize == 0 && todo > 0) || (Stored && compsize != uncompsize))
+			{
+				SetError(Target, UNPACK_CORRUPT);
+				break;
+			}
+			Consumed += sizeof(uLongf) + sizeof(int) + compsize;
+
+			if(Offset == 0 && uncompsize < e->DataSize)
+			{
+				// several chunks will write at once, so open it here and reserve the whole file
+				Target->Out = CreateFile(GetPath(e).c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+				if(Target->Out == INVALID_HANDLE_VALUE)
+				{
+					Target->Out = NULL;
+					SetError(Target, UNPACK_WRITE);
+					break;
+				}
+				LARGE_INTEGER Size;
+				Size.QuadPart = e->DataSize;
+				if(SetFilePointerEx(Target->Out, Size, NULL, FILE_BEGIN))
+					SetEndOfFile(Target->Out);
+			}
+
+			DecompressSlot *s = AcquireSlot();
+			s->Target = Target;
+			s->InputSize = compsize;
+			s->Stored = Stored;
+			s->OutputSize = uncompsize;
+			s->Offset = Offset;
+			if(Read(f, s->Input, compsize) != compsize)
+			{
+				ReleaseSlot(s);
+				SetError(Target, UNPACK_CORRUPT);
+				break;
+			}
+
+			// an empty file still has its (empty) chunk, it only needs to be created
+			InterlockedIncrement(&Target->Pending);
+			mPool.Submit(s);
+
+			Offset += uncompsize;
+			todo -= uncompsize;
+		} while(todo > 0 && !mFailed);
+
+		ReleaseTarget(Target);
+		return Consumed;
+	}
+
+	// reads the single chunk of a solid block, its files are written as soon as it is inflated
+	__int64 UnpackBlock(FileType f, std::vector<FileEntry*> &Files, const std::vector<unsigned int> &Members)
+	{
+		FileEntry *e = Files[Members[0]];
+		uLongf compsize = 0;
+		int uncompsize = 0;
+		Read(f, &compsize, sizeof(uLongf));
+		bool Stored = (compsize & CHUNK_STORED) != 0;
+		compsize &= ~(CHUNK_STORED | CHUNK_DICTIONARY);
+		bool Valid = Read(f, &uncompsize, sizeof(int)) == sizeof(int) && compsize <= mInputCapacity && uncompsize >= 0 && uncompsize <= mMaxChunkSize && (!Stored || compsize == uncompsize);
+		for(unsigned int i = 0; i < Members.size() && Valid; i++)
+		{
+			FileEntry *m = Files[Members[i]];
+			Valid = m->SolidOffset >= 0 && m->DataSize >= 0 && m->SolidOffset + m->DataSize <= uncompsize;
+		}
+		if(!Valid)
+		{
+			Fail(e, Members[0], UNPACK_CORRUPT);
+			return 0;
+		}
+
+		DecompressSlot *s = AcquireSlot();
+		s->Target = NULL;
+		s->InputSize = compsize;
+		s->Stored = Stored;
+		s->OutputSize = uncompsize;
+		s->Offset = 0;
+		if(Read(f, s->Input, compsize) != compsize)
+		{
+			ReleaseSlot(s);
+			Fail(e, Members[0], UNPACK_CORRUPT);
+			return 0;
+		}
+		for(unsigned int i = 0; i < Members.size(); i++)
+		{
+			UnpackTarget *Target = new UnpackTarget;
+			Target->Entry = Files[Members[i]];
+			Target->Index = Members[i];
+			Target->Out = NULL;
+			Target->Pending = 1;
+			Target->Error = UNPACK_OK;
+			s->Block.push_back(Target);
+		}
+		mPool.Submit(s);
+		return sizeof(uLongf) + sizeof(int) + compsize;
+	}
+
+	void Fail(FileEntry *e, int Index, int Error)
+	{
+		EnterCriticalSection(&mLock);
+		if(mErrorIndex < 0 || Index < mErrorIndex)
+		{
+			mErrorIndex = Index;
+			mError = Error;
+			mErrorPath = GetPath(e);
+		}
+		mFailed = 1;
+		LeaveCriticalSection(&mLock);
+	}
+
+	// waits for all outstanding chunks and reports the first failed file in package order
+	bool Finish()
+	{
+		WaitIdle();
+		if(!mFailed)
+			return true;
+
+		std::string Message;
+		switch(mError)
+		{
+			case UNPACK_CORRUPT :
+				Message = "The mod package is corrupted\n\n" + mErrorPath;
+				ShowError(Message, "Fatal error");
+				break;
+			case UNPACK_DECOMPRESS :
+				Message = "Error while decompressing data\n\n" + mErrorPath;
+				ShowError(Message, "Fatal error");
+				break;
+			case UNPACK_WRITE :
+				Message = "Could not write file\n\n" + mErrorPath;
+				ShowError(Message, "Fatal error");
+				break;
+		}
+		return false;
+	}
+
+	// a slot is handed back after its target has been released, so once every slot is
+	// free all files are closed
+	void WaitIdle()
+	{
+		for(unsigned int i = 0; i < mSlots.size(); i++)
+			WaitPumping(mFree);
+		ReleaseSemaphore(mFree, mSlots.size(), NULL);
+	}
+
+	void ReleaseSlot(DecompressSlot *s)
+	{
+		EnterCriticalSection(&mLock);
+		mFreeSlots.push_back(s);
+		LeaveCriticalSection(&mLock);
+		ReleaseSemaphore(mFree, 1, NULL);
+	}
+
+	void ReleaseTarget(UnpackTarget *Target)
+	{
+		if(InterlockedDecrement(&Target->Pending) != 0)
+			return;
+
+		if(Target->Out)
+			CloseHandle(Target->Out);
+		if(Target->Error != UNPACK_OK)
+			Fail(Target->Entry, Target->Index, Target->Error);
+		delete Target;
+	}
+
+private:
+	DecompressSlot *AcquireSlot()
+	{
+		WaitPumping(mFree);
+		EnterCriticalSection(&mLock);
+		DecompressSlot *s = mFreeSlots.back();
+		mFreeSlots.pop_back();
+		LeaveCriticalSection(&mLock);
+		return s;
+	}
+
+	CWorkerPool mPool;
+	int mMaxChunkSize;
+	std::string mDictionary;
+	uLongf mInputCapacity;
+	CRITICAL_SECTION mLock;
+	std::vector<DecompressSlot*> mSlots;
+	std::vector<DecompressSlot*> mFreeSlots;
+	HANDLE mFree;		// counts mFreeSlots
+	volatile LONG mFailed;
+	int mErrorIndex;
+	int mError;
+	std::string mErrorPath;
+};
+
+void DecompressSlot::Run(WorkerContext *Context)
+{
+	if(!Block.empty())
+	{
+		RunBlock(Context);
+		return;
+	}
+
+	UnpackTarget *t = Target;
+	if(!t->Out)
+	{
+		// several chunks share the handle UnpackFile opened, only a single chunk is left to its worker
+		if(Offset == 0 && OutputSize == t->Entry->DataSize)
+			t->Out = CreateFile(GetPath(t->Entry).c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if(!t->Out || t->Out == INVALID_HANDLE_VALUE)
+		{
+			t->Out = NULL;
+			SetError(t, UNPACK_WRITE);
+		}
+	}
+
+	if(t->Error == UNPACK_OK && OutputSize > 0)
+	{
+		unsigned char *Data = Input;
+		if(!Stored)
+		{
+			// always the largest size, so every thread allocates its buffer only once
+			Data = Context->GetBuffer(Pipeline->GetMaxChunkSize());
+			uLongf decompsize = OutputSize;
+			int Result = UncompressChunk(Context, Data, &decompsize, Input, InputSize, (const Bytef*)Pipeline->GetDictionary().data(), Pipeline->GetDictionary().length());
+			if(Result != Z_OK || decompsize != OutputSize)
+				SetError(t, UNPACK_DECOMPRESS);
+		}
+		if(t->Error == UNPACK_OK)
+		{
+			OVERLAPPED ov;
+			memset(&ov, 0, sizeof(ov));
+			ov.Offset = (DWORD)Offset;
+			ov.OffsetHigh = (DWORD)(Offset >> 32);
+			DWORD w = 0;
+			if(!WriteFile(t->Out, Data, OutputSize, &w, &ov) || w != OutputSize)
+				SetError(t, UNPACK_WRITE);
+		}
+	}
+
+	Pipeline->ReleaseTarget(t);
+	Pipeline->ReleaseSlot(this);
+}
+
+void DecompressSlot::RunBlock(WorkerContext *Context)
+{
+	unsigned char *Data = Input;
+	int Error = UNPACK_OK;
+	if(!Stored && OutputSize > 0)
+	{
+		Data = Context->GetBuffer(Pipeline->GetMaxChunkSize());
+		uLongf decompsize = OutputSize;
+		int Result = UncompressChunk(Context, Data, &decompsize, Input, InputSize, (const Bytef*)Pipeline->GetDictionary().data(), Pipeline->GetDictionary().length());
+		if(Result != Z_OK || decompsize != OutputSize)
+			Error = UNPACK_DECOMPRESS;
+	}
+
+	for(std::vector<UnpackTarget*>::iterator i = Block.begin(); i != Block.end(); i++)
+	{
+		UnpackTarget *t = *i;
+		SetError(t, Error);
+		if(t->Error == UNPACK_OK)
+		{
+			t->Out = CreateFile(GetPath(t->Entry).c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			DWORD w = 0;
+			if(t->Out == INVALID_HANDLE_VALUE)
+			{
+				t->Out = NULL;
+				SetError(t, UNPACK_WRITE);
+			} else if(!WriteFile(t->Out, Data + t->Entry->SolidOffset, (DWORD)t->Entry->DataSize, &w, NULL) || w != t->Entry->DataSize)
+				SetError(t, UNPACK_WRITE);
+		}
+		Pipeline->ReleaseTarget(t);
+	}
+	Block.clear();
+	Pipeline->ReleaseSlot(this);
+}
+
+bool CompareDataOffset(const FileEntry *a, const FileEntry *b)
+{
+	if(a->DataOffset != b->DataOffset)
+		return a->DataOffset < b->DataOffset;
+	return a->SolidOffset < b->SolidOffset;
+}
+
+// deduplicated entries share their data, it is inflated only once and copied later
+bool IsDuplicate(const FileEntry *a, const FileEntry *b)
+{
+	return a->DataOffset == b->DataOffset && a->SolidOffset == b->SolidOffset && a->DataSize == b->DataSize && a->DataSize > 0;
+}
+
+bool UnpackFiles(FileType f, std::vector<FileEntry*> &Files, int ChunkSize, const std::string &Dictionary)
+{
+	// CopyFiles stores the data in directory order, so in offset order this is a single
+	// pass through the package. Seeking (which means inflating from the start again for
+	// compressed packages) is only needed where the data is not contiguous.
+	std::stable_sort(Files.begin(), Files.end(), CompareDataOffset);
+
+	// buffers are allocated once per worker, however many files and chunks there are
+	LONG Allocations = NumBufferAllocations;
+	CDecompressPipeline Pipeline(ChunkSize, Dictionary);
+	__int64 Position = Tell(f);
+	std::vector<std::pair<unsigned int, unsigned int> > Copies;	// source, destination
+	for(unsigned int i = 0; i < Files.size() && !Pipeline.HasFailed();)
+	{
+		PumpMessages();
+		FileEntry *e = Files[i];
+		if(e->DataOffset != Position)
+		{
+			if(Seek(f, e->DataOffset, SEEK_SET) < 0)
+			{
+				Pipeline.Fail(e, i, UNPACK_CORRUPT);
+				break;
+			}
+			Position = e->DataOffset;
+		}
+
+		unsigned int Next = i + 1;
+		if(e->SolidOffset >= 0)
+		{
+			// everything at this offset lives in the same block
+			std::vector<unsigned int> Members(1, i);
+			for(; Next < Files.size() && Files[Next]->DataOffset == e->DataOffset; Next++)
+			{
+				if(IsDuplicate(Files[Members.back()], Files[Next]))
+					Copies.push_back(std::make_pair(Members.back(), Next));
+				else
+					Members.push_back(Next);
+			}
+			Position += Pipeline.UnpackBlock(f, Files, Members);
+		} else
+		{
+			Position += Pipeline.UnpackFile(f, e, i);
+			for(; Next < Files.size() && IsDuplicate(e, Files[Next]); Next++)
+				Copies.push_back(std::make_pair(i, Next));
+		}
+		i = Next;
+	}
+
+	// the sources have to be complete
+	Pipeline.WaitIdle();
+	for(unsigned int i = 0; i < Copies.size() && !Pipeline.HasFailed(); i++)
+	{
+		PumpMessages();
+		FileEntry *e = Files[Copies[i].second];
+		if(!CopyFile(GetPath(Files[Copies[i].first]).c_str(), GetPath(e).c_str(), FALSE))
+			Pipeline.Fail(e, Copies[i].second, UNPACK_WRITE);
+	}
+	bool Result = Pipeline.Finish();
+
+	static char Line[256];
+	sprintf(Line, "%d files unpacked, %d buffers allocated\n", (int)Files.size(), (int)(NumBufferAllocations - Allocations));
+	InstallReport = Line;
+#ifdef DEBUG
+	OutputDebugString(Line);
+#endif
+	return Result;
+}
+
+void CreateFolders(ModContents *Node)
+{
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	{
+		PumpMessages();
+		int cd = CreateDirectory((*i)->Path.c_str(), NULL);
+		assert(cd != 0);
+		CreateFolders(*i);
+	}
+}
+
+void ShowPackageError(PackageError Error)
+{
+	switch(Error)
+	{
+		case PACKAGE_INVALID :
+			ShowError("This is not a valid modification package.", "Corrupt file");
+			break;
+		case PACKAGE_TOO_NEW :
+			ShowError("This modification package format is newer than the latest supported version. Please go to the Emergency 4 website to obtain an Emergency 4 program update.", "File too new");
+			break;
+		case PACKAGE_CORRUPT :
+			ShowError("The mod package is corrupted", "Fatal Error");
+			break;
+	}
+}
+
+bool UnpackPackage(FileType f, const std::string &InstallPath)
+{
+	ModPackageHeader h;
+	std::string Dictionary;
+	PackageError Error = ReadPackageHeader(f, h, Dictionary);
+	if(Error != PACKAGE_OK)
+	{
+		ShowPackageError(Error);
+		return false;
+	}
+
+	if(!strcmp(h.ID, "E4PT"))
+		return ApplyPatch(f, h, Dictionary, InstallPath);
+
+	ModContents Contents;
+	if(!ReadPackageContents(f, h.Version, Contents))
+	{
+		FreeFolder(&Contents);
+		ShowPackageError(PACKAGE_CORRUPT);
+		return false;
+	}
+	std::string MyName = Contents.Name;
+	
+	SetCurrentDirectory(InstallPath.c_str());
+	if(SetCurrentDirectory(MyName.c_str())!=0)
+	{
+		FreeFolder(&Contents);
+		MessageBox(Dialog, "There appears to be a modification with the same name installed. Can't install modification.\n\nRemove or rename the existent modification folder in order to install this modification package.", "Error", MB_OK | MB_ICONSTOP);
+		return false;
+	}
+	
+	int cd = CreateDirectory(MyName.c_str(), NULL);
+	assert(cd != 0);	
+	int scd = SetCurrentDirectory(MyName.c_str());
+	assert(scd != 0);
+	
+	SetFolderPaths(&Contents, InstallPath + "\\" + MyName);
+	CreateFolders(&Contents);
+	std::vector<FileEntry*> Files;
+	CollectFiles(&Contents, Files);
+	ShowWindow(Progress, SW_SHOW);
+	bool Result = UnpackFiles(f, Files, h.ChunkSize, Dictionary);
+	FreeFolder(&Contents);
+	if(!Result)
+	{
+		MessageBox(Dialog, "The mod package is corrupted", "Fatal Error", MB_OK | MB_ICONSTOP);
+		return false;
+	}
+	ShowWindow(Progress, SW_HIDE);
+	SetActiveWindow(Dialog);
+	BringWindowToTop(Dialog);
+
+	// Create Key File
+	std::string keyFileName = InstallPath + "\\" + MyName + "\\e4mod.key" ;
+	FILE* keyFile = fopen(keyFileName.c_str(), "wb");
+	if (!keyFile)
+	{
+		MessageBox(Dialog, "Could not create key file. Aborting.", "Fatal Error", MB_OK | MB_ICONSTOP);
+		return false;
+	}
+
+	CComputerCheckSum generator;
+	unsigned long checkSum = generator.GetComputerChecksum();
+	fwrite(&checkSum,1,sizeof(checkSum),keyFile);
+	fclose(keyFile);
+	return true;
+}
+
+// the files that match, and the folders on the way to them in the order they must be created
+void SelectFiles(ModContents *Node, const std::string &Prefix, const std::string &Pattern, std::vector<FileEntry*> &Files, std::vector<ModContents*> &Folders)
+{
+	size_t NumFolders = Folders.size();
+	size_t NumFiles = Files.size();
+	Folders.push_back(Node);
+
+	bool ByPath = Pattern.find('\\') != std::string::npos;
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	{
+		if(WildcardMatch(Pattern.c_str(), ByPath ? (Prefix + GetName(&*i)).c_str() : GetName(&*i)))
+			Files.push_back(&*i);
+	}
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+		SelectFiles(*i, Prefix + (*i)->Name + "\\", Pattern, Files, Folders);
+
+	if(Files.size() == NumFiles)
+		Folders.resize(NumFolders);
+}
+
+// Extracts the files whose path inside the mod matches Pattern into Folder, keeping their
+// folders. As in the packing profile, a pattern without a backslash matches the file name in
+// any folder. Only the directory and the data of those files are read.
+bool ExtractFiles(const std::string &PackageFile, const std::string &Pattern, const std::string &Folder, int &NumExtracted)
+{
+	NumExtracted = 0;
+	FileType f = Open(PackageFile.c_str(), "rb");
+	if(!f)
+	{
+		ShowError("Could not open " + PackageFile, "Error");
+		return false;
+	}
+
+	ModPackageHeader h;
+	std::string Dictionary;
+	ModContents Contents;
+	PackageError Error = ReadPackageHeader(f, h, Dictionary);
+	if(Error == PACKAGE_OK && !strcmp(h.ID, "E4PT"))
+		Error = PACKAGE_INVALID;
+	if(Error == PACKAGE_OK && !ReadPackageContents(f, h.Version, Contents))
+		Error = PACKAGE_CORRUPT;
+	if(Error != PACKAGE_OK)
+	{
+		FreeFolder(&Contents);
+		Close(f);
+		ShowPackageError(Error);
+		return false;
+	}
+
+	std::string Match = Pattern;
+	std::replace(Match.begin(), Match.end(), '/', '\\');
+	SetFolderPaths(&Contents, Folder);
+	std::vector<FileEntry*> Files;
+	std::vector<ModContents*> Folders;
+	SelectFiles(&Contents, "", Match, Files, Folders);
+	for(std::vector<ModContents*>::iterator i = Folders.begin(); i != Folders.end(); i++)
+		CreateDirectory((*i)->Path.c_str(), NULL);
+
+	bool Result = UnpackFiles(f, Files, h.ChunkSize, Dictionary);
+	NumExtracted = Result ? Files.size() : 0;
+	FreeFolder(&Contents);
+	Close(f);
+	return Result;
+}
+
+// -cat writes one file of a package to stdout, without installing or extracting anything
+bool CatFile(const std::string &PackageFile, const std::string &Path)
+{
+	CPackageFileSystem FileSystem;
+	if(!FileSystem.Mount(PackageFile))
+	{
+		ShowError("Could not read the modification package " + PackageFile, "Error");
+		return false;
+	}
+	CPackageStream *Stream = FileSystem.OpenStream(Path);
+	if(!Stream)
+	{
+		ShowError("There is no file " + Path + " in " + PackageFile, "Error");
+		return false;
+	}
+
+	_setmode(_fileno(stdout), _O_BINARY);
+	static char Buffer[0x10000];
+	int r;
+	while((r = Stream->ReadData(Buffer, sizeof(Buffer))) > 0 && fwrite(Buffer, 1, r, stdout) == (size_t)r)
+		;
+	delete Stream;
+	if(r < 0)
+	{
+		ShowError("The mod package is corrupted", "Fatal Error");
+		return false;
+	}
+	return fflush(stdout) == 0;
+}
+
+bool MakePackage(int Item)
+{
+	LPARAM value = SendMessage(GetDlgItem(Dialog, IDC_MODLIST), LB_GETITEMDATA, (WPARAM)Item, 0);
+	if(value == LB_ERR)
+		return false;
+
+	ModListInfo *mli = reinterpret_cast<ModListInfo*>(value);
+	assert(mli);
+	if(!mli)
+		return false;
+		
+	if(!InitPackProfile())
+	{
+		std::string Message = "Could not load the packing profile " + ProfileFile;
+		MessageBox(Dialog, Message.c_str(), "Error", MB_OK | MB_ICONSTOP);
+		return false;
+	}
+
+	std::string filename = ChooseDestinationPackage();
+	if(filename.length()==0)
+		return false;
+
+	// an existing package is only replaced once the new one is complete, and whatever did
+	// not change since is taken from it
+	CPreviousPackage Previous;
+	bool Replace = GetFileAttributes(filename.c_str()) != INVALID_FILE_ATTRIBUTES;
+	bool Incremental = Replace && !FullRepack && Previous.Load(filename, GetPackChunkSize());
+	if(!Incremental)
+		Previous.Unload();
+	std::string TempFile = Replace ? filename + ".tmp" : filename;
+	FileType f = Open(TempFile.c_str(), "wb");
+	assert(f);
+	if(!f)
+		return false;
+	
+	EnableWindow(Dialog, FALSE);
+	ShowWindow(Progress, SW_SHOW);
+
+	// chunks taken over from the previous package need the dictionary they were primed with
+	std::string Dictionary = Previous.GetDictionary();
+	if(Dictionary.empty() && UseDictionary)
+		BuildDictionary(&mli->Contents, Dictionary);
+
+	ModPackageHeader h;
+	strcpy(h.ID, "E4MP");
+	h.ID[4]=0;
+	h.Version = FILEVERSION;
+	h.ChunkSize = GetPackChunkSize();
+	Write(f, h.ID, 5);
+	Write(f, &h.Version, sizeof(int));
+	Write(f, &h.ChunkSize, sizeof(int));
+	__int64 Position = PACKAGE_HEADERSIZE + WriteDictionary(f, Dictionary);
+	
+	static char defdir[1024];
+	int r = mli->Path.find_last_of('\\', mli->Path.length())+1;
+	int l = mli->Path.length() - r;
+	mli->Contents.Name = mli->Path.substr(r, l);
+	bool Result = CopyFiles(f, Position, &mli->Contents, h.ChunkSize, Dictionary, Incremental ? &Previous : NULL);
+	PackReport = GetPackReport();
+	if(Result)
+	{
+		// the offsets are known now, so the directory simply follows the data
+		int DirectorySize = WritePackageInfo(f, &mli->Contents);
+		Result = WritePackageFooter(f, Position, DirectorySize);
+	}
+	ShowWindow(Progress, SW_HIDE);
+	SetActiveWindow(Dialog);
+	BringWindowToTop(Dialog);
+	
+	Close(f);
+	Previous.Unload();
+	if(Result && Replace && !MoveFileEx(TempFile.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+	{
+		std::string Message = "Could not replace " + filename;
+		MessageBox(Dialog, Message.c_str(), "Error", MB_OK | MB_ICONSTOP);
+		Result = false;
+	}
+	if(!Result)
+		DeleteFile(TempFile.c_str());
+	EnableWindow(Dialog, TRUE);
+	return Result;
+}
+
+// A patch package turns an installed mod into a newer version. Its data section holds the
+// new and changed files like a package does, changed files possibly as a delta against the
+// installed version. The directory is a list of operations instead of a tree.
+enum PatchOperationType
+{
+	PATCH_MKDIR = 1,
+	PATCH_ADD,			// new file, stored whole
+	PATCH_REPLACE,		// changed file, stored whole
+	PATCH_DELTA,		// changed file, stored as a delta against the installed one
+	PATCH_REMOVE,
+	PATCH_RMDIR
+};
+
+struct PatchOperation
+{
+	int Type;
+	std::string Path;		// relative to the mod folder
+	FileEntry Entry;		// data of ADD, REPLACE and DELTA
+	__int64 Size;			// of the new file
+	__int64 BaseSize;		// REPLACE and DELTA only apply onto this version
+	ContentHash Hash;
+	ContentHash BaseHash;
+};
+
+typedef std::list<PatchOperation> PatchOperationList;
+
+#define DELTA_BLOCKSIZE	2048
+#define DELTA_MINSIZE	0x10000		// smaller files are simply stored again
+#define DELTA_MAXSIZE	0x4000000	// both versions are held in memory
+#define DELTA_COPY		1			// __int64 offset in the installed file, int length
+#define DELTA_INSERT	2			// int length, data
+
+// rsync's weak checksum, it can be moved along by one byte
+struct RollingChecksum
+{
+	unsigned int a, b;
+
+	void Init(const unsigned char *Data, int Size)
+	{
+		a = b = 0;
+		for(int i = 0; i < Size; i++)
+		{
+			a += Data[i];
+			b += (Size - i) * Data[i];
+		}
+	}
+	void Roll(unsigned char Out, unsigned char In, int Size)
+	{
+		a += In - Out;
+		b += a - Size * Out;
+	}
+	unsigned int Get() const
+	{
+		return (a & 0xffff) | (b << 16);
+	}
+};
+
+void AppendDelta(std::vector<unsigned char> &Delta, const void *Data, int Size)
+{
+	const unsigned char *p = reinterpret_cast<const unsigned char*>(Data);
+	Delta.insert(Delta.end(), p, p + Size);
+}
+
+void AppendInsert(std::vector<unsigned char> &Delta, const unsigned char *Data, int Size)
+{
+	if(Size == 0)
+		return;
+	unsigned char Op = DELTA_INSERT;
+	AppendDelta(Delta, &Op, 1);
+	AppendDelta(Delta, &Size, sizeof(int));
+	AppendDelta(Delta, Data, Size);
+}
+
+void AppendCopy(std::vector<unsigned char> &Delta, __int64 Offset, int Size)
+{
+	unsigned char Op = DELTA_COPY;
+	AppendDelta(Delta, &Op, 1);
+	AppendDelta(Delta, &Offset, sizeof(__int64));
+	AppendDelta(Delta, &Size, sizeof(int));
+}
+
+// The old version is split into blocks, the new one is searched for them at every byte
+// offset with the rolling checksum. Matches are extended as far as they go.
+void MakeDelta(const std::vector<unsigned char> &Old, const std::vector<unsigned char> &New, std::vector<unsigned char> &Delta)
+{
+	int NumBlocks = Old.size() / DELTA_BLOCKSIZE;
+	int TableSize = 0x400;
+	while(TableSize < NumBlocks * 2)
+		TableSize *= 2;
+	std::vector<int> Table(TableSize, -1);
+	std::vector<int> Next(NumBlocks + 1, -1);
+	std::vector<unsigned int> Sums(NumBlocks + 1);
+	RollingChecksum c;
+	for(int i = NumBlocks - 1; i >= 0; i--)
+	{
+		c.Init(&Old[i * DELTA_BLOCKSIZE], DELTA_BLOCKSIZE);
+		Sums[i] = c.Get();
+		int Bucket = (Sums[i] ^ (Sums[i] >> 16)) & (TableSize - 1);
+		Next[i] = Table[Bucket];
+		Table[Bucket] = i;
+	}
+
+	int Size = New.size();
+	int Literal = 0;	// start of the data not covered by a copy yet
+	int p = 0;
+	bool Valid = false;
+	while(NumBlocks > 0 && p + DELTA_BLOCKSIZE <= Size)
+	{
+		if(!Valid)
+		{
+			c.Init(&New[p], DELTA_BLOCKSIZE);
+			Valid = true;
+		}
+		unsigned int Sum = c.Get();
+		int Match = -1;
+		for(int i = Table[(Sum ^ (Sum >> 16)) & (TableSize - 1)]; i >= 0; i = Next[i])
+		{
+			if(Sums[i] == Sum && !memcmp(&Old[i * DELTA_BLOCKSIZE], &New[p], DELTA_BLOCKSIZE))
+			{
+				Match = i;
+				break;
+			}
+		}
+		if(Match < 0)
+		{
+			if(p + DELTA_BLOCKSIZE < Size)
+				c.Roll(New[p], New[p + DELTA_BLOCKSIZE], DELTA_BLOCKSIZE);
+			p++;
+			continue;
+		}
+
+		int Offset = Match * DELTA_BLOCKSIZE;
+		int Length = DELTA_BLOCKSIZE;
+		while(p + Length < Size && Offset + Length < (int)Old.size() && Old[Offset + Length] == New[p + Length])
+			Length++;
+		AppendInsert(Delta, &New[Literal], p - Literal);
+		AppendCopy(Delta, Offset, Length);
+		p += Length;
+		Literal = p;
+		Valid = false;
+	}
+	if(Literal < Size)
+		AppendInsert(Delta, &New[Literal], Size - Literal);
+}
+
+// rebuilds Target from Base and an unpacked delta, the result has to match Hash
+bool ApplyDelta(const std::string &Base, const std::string &Delta, const std::string &Target, const ContentHash &Hash)
+{
+	FILE* base = fopen(Base.c_str(), "rb");
+	FILE* delta = fopen(Delta.c_str(), "rb");
+	FILE* output = fopen(Target.c_str(), "wb");
+	CContentHasher Hasher;
+	bool Result = base && delta && output && Hasher.Begin();
+
+	std::vector<unsigned char> Buffer(0x10000);
+	unsigned char Op;
+	while(Result && fread(&Op, 1, 1, delta) == 1)
+	{
+		FILE* Source = delta;
+		if(Op == DELTA_COPY)
+		{
+			__int64 Offset = 0;
+			Result = fread(&Offset, sizeof(__int64), 1, delta) == 1 && _fseeki64(base, Offset, SEEK_SET) == 0;
+			Source = base;
+		} else if(Op != DELTA_INSERT)
+			Result = false;
+
+		int Length = 0;
+		Result = Result && fread(&Length, sizeof(int), 1, delta) == 1 && Length >= 0;
+		while(Result && Length > 0)
+		{
+			int n = Length < (int)Buffer.size() ? Length : Buffer.size();
+			Result = fread(&Buffer[0], 1, n, Source) == n && fwrite(&Buffer[0], 1, n, output) == n;
+			Hasher.Update(&Buffer[0], n);
+			Length -= n;
+		}
+	}
+	if(delta && ferror(delta))
+		Result = false;
+
+	if(base)
+		fclose(base);
+	if(delta)
+		fclose(delta);
+	if(output && fclose(output))
+		Result = false;
+	ContentHash Digest;
+	return Hasher.End(Digest) && Result && Digest == Hash;
+}
+
+void CollectPatchFiles(ModContents *Node, const std::string &Prefix, std::map<std::string, FileEntry*> &Files, std::map<std::string, ModContents*> &Folders)
+{
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+		Files[FoldPath(Prefix + GetName(&*i))] = &*i;
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	{
+		Folders[FoldPath(Prefix + (*i)->Name)] = *i;
+		CollectPatchFiles(*i, Prefix + (*i)->Name + "\\", Files, Folders);
+	}
+}
+
+// folders before their contents, files the old version has as well get its size and hash
+bool DiffNewFolder(ModContents *Node, const std::string &Prefix, std::map<std::string, FileEntry*> &OldFiles, std::map<std::string, ModContents*> &OldFolders,
+	CContentHasher &Hasher, PatchOperationList &Operations)
+{
+	PumpMessages();
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	{
+		PatchOperation Op;
+		Op.Type = PATCH_ADD;
+		Op.Path = Prefix + GetName(&*i);
+		Op.Entry = *i;
+		Op.Size = Op.BaseSize = 0;
+
+		std::map<std::string, FileEntry*>::iterator Old = OldFiles.find(FoldPath(Op.Path));
+		if(Old != OldFiles.end())
+		{
+			ContentHash Digest;
+			if(!Hasher.HashFile(GetPath(Old->second), Op.BaseHash) || !Hasher.HashFile(GetPath(&Op.Entry), Digest))
+				return false;
+			Op.BaseSize = Old->second->DataSize;
+			if(Digest == Op.BaseHash)
+				continue;
+			Op.Type = PATCH_REPLACE;
+		}
+		Operations.push_back(Op);
+	}
+
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	{
+		std::string Path = Prefix + (*i)->Name;
+		if(OldFolders.find(FoldPath(Path)) == OldFolders.end())
+		{
+			PatchOperation Op;
+			Op.Type = PATCH_MKDIR;
+			Op.Path = Path;
+			Op.Size = Op.BaseSize = 0;
+			Op.Entry.DataOffset = Op.Entry.DataSize = 0;
+			Operations.push_back(Op);
+		}
+		if(!DiffNewFolder(*i, Path + "\\", OldFiles, OldFolders, Hasher, Operations))
+			return false;
 	}
-	
-	for(std::list<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
-		CopyFiles(File, (*i));
-		
 	return true;
 }
 
-void WritePackageInfo(FileType File, ModContents *Node)
+// files and folders the new version lacks, contents before their folders
+void DiffOldFolder(ModContents *Node, const std::string &Prefix, std::map<std::string, FileEntry*> &NewFiles, std::map<std::string, ModContents*> &NewFolders,
+	PatchOperationList &Operations)
 {
-	assert(File);
-	assert(Node);
-	int l = Node->Name.length()+1;
-	Write(File, &l, sizeof(int));
-	Write(File, Node->Name.c_str(), l);
-	
-	int NumFolders = Node->SubFolders.size();
-	Write(File, &NumFolders, sizeof(int));
-	for(std::list<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
 	{
-		int l = (*i)->Name.length()+1;
-		Write(File, &l, sizeof(int));
-		Write(File, (*i)->Name.c_str(), l);
+		std::string Path = Prefix + (*i)->Name;
+		DiffOldFolder(*i, Path + "\\", NewFiles, NewFolders, Operations);
+		if(NewFolders.find(FoldPath(Path)) == NewFolders.end())
+		{
+			PatchOperation Op;
+			Op.Type = PATCH_RMDIR;
+			Op.Path = Path;
+			Op.Size = Op.BaseSize = 0;
+			Op.Entry.DataOffset = Op.Entry.DataSize = 0;
+			Operations.push_back(Op);
+		}
 	}
-	int NumFiles = Node->Files.size();
-	Write(File, &NumFiles, sizeof(int));
-	for(std::list<FileEntry*>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
+	for(std::vector<FileEntry>::iterator i = Node->Files.begin(); i != Node->Files.end(); i++)
 	{
-		int l = (*i)->Name.length()+1;
+		std::string Path = Prefix + GetName(&*i);
+		if(NewFiles.find(FoldPath(Path)) != NewFiles.end())
+			continue;
+		PatchOperation Op;
+		Op.Type = PATCH_REMOVE;
+		Op.Path = Path;
+		Op.Size = Op.BaseSize = 0;
+		Op.Entry.DataOffset = Op.Entry.DataSize = 0;
+		Operations.push_back(Op);
+	}
+}
+
+// returns the number of bytes written
+int WritePatchInfo(FileType File, const std::string &ModName, PatchOperationList &Operations)
+{
+	int l = ModName.length()+1;
+	Write(File, &l, sizeof(int));
+	Write(File, ModName.c_str(), l);
+	int NumOperations = Operations.size();
+	Write(File, &NumOperations, sizeof(int));
+	int Size = 2 * sizeof(int) + l;
+	for(PatchOperationList::iterator i = Operations.begin(); i != Operations.end(); i++)
+	{
+		Write(File, &i->Type, sizeof(int));
+		int l = i->Path.length()+1;
 		Write(File, &l, sizeof(int));
-		Write(File, (*i)->Name.c_str(), l);
-		Write(File, &(*i)->DataOffset, sizeof(int));
-		Write(File, &(*i)->DataSize, sizeof(int));
+		Write(File, i->Path.c_str(), l);
+		Write(File, &i->Entry.DataOffset, sizeof(__int64));
+		Write(File, &i->Entry.DataSize, sizeof(__int64));
+		Write(File, &i->Size, sizeof(__int64));
+		Write(File, &i->BaseSize, sizeof(__int64));
+		WriteHash(File, i->Hash);
+		WriteHash(File, i->BaseHash);
+		Size += 2 * sizeof(int) + l + 4 * sizeof(__int64) + 40;
 	}
+	return Size;
+}
 
-	for(std::list<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
-		WritePackageInfo(File, *i);
+// the paths come from the package, they must stay inside the mod folder
+bool IsPatchPathSafe(const std::string &Path)
+{
+	return !Path.empty() && Path[0] != '\\' && Path[0] != '/' && Path.find(':') == std::string::npos && Path.find("..") == std::string::npos;
 }
 
-bool UnpackFiles(FileType f, std::vector<FileEntry*> &Files)
+bool ReadPatchInfo(CDirectoryReader &Directory, std::string &ModName, PatchOperationList &Operations)
 {
-	for(std::vector<FileEntry*>::iterator i = Files.begin(); i != Files.end(); i++)
+	// the mod name is a single folder right below the Mods folder
+	if(!Directory.GetName(ModName) || !IsPatchPathSafe(ModName) || ModName.find_first_of("\\/") != std::string::npos)
+		return false;
+	int NumOperations = Directory.GetCount();
+	if(NumOperations < 0)
+		return false;
+	for(int i = 0; i < NumOperations; i++)
 	{
-		MSG msg;
-		if(PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
-		{
-			if(!IsDialogMessage(Dialog, &msg))
-			{
-				TranslateMessage(&msg);
-				DispatchMessage(&msg);
-			}
-		}		
-		Rewind(f);
-		FileEntry *e = *i;
-		Seek(f, e->DataOffset, SEEK_SET);
-		
-		FILE *out = fopen(e->Fullpath.c_str(), "wb");
-		if(!out)
+		PatchOperation Op;
+		if(!Directory.Get(Op.Type) || Op.Type < PATCH_MKDIR || Op.Type > PATCH_RMDIR || !Directory.GetName(Op.Path) ||
+			!Directory.Get(Op.Entry.DataOffset) || !Directory.Get(Op.Entry.DataSize) || !Directory.Get(Op.Size) || !Directory.Get(Op.BaseSize) ||
+			!Directory.GetData(Op.Hash.Value, 20) || !Directory.GetData(Op.BaseHash.Value, 20))
 			return false;
-		
-		static unsigned char compbuffer[0x12000];
-		unsigned char *uncompbuffer = NULL;
-		
-		uLongf compsize;
-		int uncompsize;
-		Read(f, &compsize, sizeof(uLongf));
-		Read(f, &uncompsize, sizeof(int));
-
-		int todo = e->DataSize;
-		int toread = compsize;
-		int r = Read(f, compbuffer, toread);
-		do 
-		{
-			if(uncompsize > 0)
-			{
-				uncompbuffer = new unsigned char[uncompsize];
-				uLongf decompsize = uncompsize;
-				int Result = uncompress(uncompbuffer, &decompsize, compbuffer, r);
-				assert(decompsize==uncompsize);
-				if(Result!=Z_OK)
-				{
-					MessageBox(Dialog, "Error while decompressing data", "Fatal error", MB_OK | MB_ICONSTOP);
-					return false;
-				}
-				int w = fwrite(uncompbuffer, 1, decompsize, out);
-				delete [] uncompbuffer;
-				assert(w == decompsize);
-				if(w != decompsize)
-					return false;
-				
-				todo -= decompsize;
-				r = toread = 0;
-				if(todo > 0)
-				{
-					Read(f, &compsize, sizeof(uLongf));
-					Read(f, &uncompsize, sizeof(int));
-					toread = compsize;
-					if(toread > 0)
-						r = Read(f, compbuffer, toread);
-				}
-									
-				assert(r == toread);
-				assert((r!=0 && todo!=0)||(r==0&&todo==0));
-			}
-		} while(todo > 0 && r > 0);
-		fclose(out);
-		
-		delete e;
+		if(!IsPatchPathSafe(Op.Path))
+			return false;
+		Op.Hash.Valid = true;
+		Op.BaseHash.Valid = true;
+		Op.Entry.SolidOffset = -1;
+		Operations.push_back(Op);
 	}
-	
 	return true;
 }
 
-bool CreateStructure(FileType f, const std::string &MyName, const std::string &InstallPath, std::vector<FileEntry*> &Files)
+// a folder given on the command line, which may use either separator and end with one
+std::string NormalizeFolder(std::string Folder)
 {
-	std::vector<std::string> FolderList;
-	
-	int NumFolders;
-	Read(f, &NumFolders, sizeof(int));
-	for(int i=0; i<NumFolders; i++)
-	{
-		int l = 0;
-		Read(f, &l, sizeof(int));
-		char *temp = new char[l];
-		Read(f, temp, l);
-		std::string tpath = InstallPath + "\\" + temp;
-		int cd = CreateDirectory(tpath.c_str(), NULL);
-		assert(cd != 0);
-		FolderList.push_back(temp);
-		delete [] temp;
+	std::replace(Folder.begin(), Folder.end(), '/', '\\');
+	while(!Folder.empty() && Folder[Folder.length()-1] == '\\')
+		Folder.erase(Folder.length()-1);
+	return Folder;
+}
+
+// the last part of a folder given on the command line
+std::string GetModFolderName(const std::string &Folder)
+{
+	std::string Path = NormalizeFolder(Folder);
+	return Path.substr(Path.find_last_of('\\') + 1);
+}
+
+// builds a patch that updates the mod in OldPath to the one in NewPath, it applies to the
+// installed mod named like the folder of the old version
+bool MakePatch(const std::string &OldPath, const std::string &NewPath, const std::string &PatchFile)
+{
+	std::string ModName = GetModFolderName(OldPath);
+	if(ModName.empty() || !IsPatchPathSafe(ModName))
+	{
+		std::string Message = "The old version is not in a modification folder\n\n" + OldPath;
+		MessageBox(Dialog, Message.c_str(), "Error", MB_OK | MB_ICONSTOP);
+		return false;
+	}
+	if(!InitPackProfile())
+	{
+		std::string Message = "Could not load the packing profile " + ProfileFile;
+		MessageBox(Dialog, Message.c_str(), "Error", MB_OK | MB_ICONSTOP);
+		return false;
 	}
 
-	int NumFiles;
-	Read(f, &NumFiles, sizeof(int));
-	for(int i=0; i<NumFiles; i++)
-	{
-		int l = 0;
-		Read(f, &l, sizeof(int));
-		char *temp = new char[l];
-		Read(f, temp, l);
-		int Offs, Size;
-		Read(f, &Offs, sizeof(int));
-		Read(f, &Size, sizeof(int));
-		
-		FileEntry *e = new FileEntry;
-		e->DataOffset = Offs;
-		e->DataSize = Size;
-		e->Name = temp;
-		e->Fullpath = InstallPath + "\\" + e->Name;
-		Files.push_back(e);
-		delete [] temp;
+	ModContents Old, New;
+	ScanSubFolder(&Old, OldPath);
+	ScanSubFolder(&New, NewPath);
+	std::map<std::string, FileEntry*> OldFiles, NewFiles;
+	std::map<std::string, ModContents*> OldFolders, NewFolders;
+	CollectPatchFiles(&Old, "", OldFiles, OldFolders);
+	CollectPatchFiles(&New, "", NewFiles, NewFolders);
+
+	PatchOperationList Operations;
+	CContentHasher Hasher;
+	bool Result = DiffNewFolder(&New, "", OldFiles, OldFolders, Hasher, Operations);
+	if(Result)
+		DiffOldFolder(&Old, "", NewFiles, NewFolders, Operations);
+	else
+		MessageBox(Dialog, "Could not read the modification folders", "Error", MB_OK | MB_ICONSTOP);
+
+	FileType f = Result ? Open(PatchFile.c_str(), "wb") : NULL;
+	if(Result && !f)
+	{
+		MessageBox(Dialog, "Could not create the patch file", "Error", MB_OK | MB_ICONSTOP);
+		Result = false;
 	}
-	
-	for(std::vector<std::string>::iterator i = FolderList.begin(); i != FolderList.end(); i++)
+	int NumAdded = 0, NumChanged = 0, NumDeltas = 0, NumRemoved = 0;
+	if(Result)
 	{
-		MSG msg;
-		if(PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+		ModPackageHeader h;
+		strcpy(h.ID, "E4PT");
+		h.Version = FILEVERSION;
+		h.ChunkSize = GetPackChunkSize();
+		Write(f, h.ID, 5);
+		Write(f, &h.Version, sizeof(int));
+		Write(f, &h.ChunkSize, sizeof(int));
+		__int64 Position = PACKAGE_HEADERSIZE + WriteDictionary(f, "");
+
+		CCompressPipeline Pipeline(f, Position, h.ChunkSize, "", New.Path);
+		for(PatchOperationList::iterator i = Operations.begin(); i != Operations.end() && Result; i++)
 		{
-			if(!IsDialogMessage(Dialog, &msg))
+			PumpMessages();
+			if(i->Type == PATCH_REMOVE)
+				NumRemoved++;
+			if(i->Type != PATCH_ADD && i->Type != PATCH_REPLACE)
+				continue;
+
+			// a delta is only worth it if it saves at least half of the file
+			std::vector<unsigned char> OldData, NewData, Delta;
+			if(i->Type == PATCH_REPLACE && i->BaseSize >= DELTA_MINSIZE && i->BaseSize <= DELTA_MAXSIZE &&
+				LoadFile(GetPath(OldFiles[FoldPath(i->Path)]), OldData) && LoadFile(GetPath(&i->Entry), NewData) &&
+				NewData.size() >= DELTA_MINSIZE && NewData.size() <= DELTA_MAXSIZE)
 			{
-				TranslateMessage(&msg);
-				DispatchMessage(&msg);
+				MakeDelta(OldData, NewData, Delta);
+				if(Delta.size() < NewData.size() / 2)
+				{
+					i->Type = PATCH_DELTA;
+					i->Size = NewData.size();
+					Hasher.Begin();
+					Hasher.Update(&NewData[0], NewData.size());
+					Hasher.End(i->Hash);
+					Result = Pipeline.AddBuffer(&i->Entry, &Delta[0], Delta.size(), 1);
+					NumDeltas++;
+					NumChanged++;
+					continue;
+				}
 			}
-		}		
+			Result = Pipeline.AddFile(&i->Entry);
+			i->Size = i->Entry.DataSize;
+			if(i->Type == PATCH_ADD)
+				NumAdded++;
+			else
+				NumChanged++;
+		}
+		if(!Pipeline.Finish())
+			Result = false;
 
-		int l = 0;
-		Read(f, &l, sizeof(int));
-		if(l==0)
-			return false;
-		static char Name[MAX_PATH];
-		Read(f, Name, l);
-		std::string Path = InstallPath + "\\" + Name;
-		SetCurrentDirectory(Path.c_str());
-		CreateStructure(f, *i, Path, Files);
+		if(Result)
+		{
+			for(PatchOperationList::iterator i = Operations.begin(); i != Operations.end(); i++)
+			{
+				if(i->Type == PATCH_ADD || i->Type == PATCH_REPLACE)
+					i->Hash = i->Entry.Hash;
+			}
+			int DirectorySize = WritePatchInfo(f, ModName, Operations);
+			Result = WritePackageFooter(f, Pipeline.GetPosition(), DirectorySize);
+		}
+		Close(f);
+		if(!Result)
+			DeleteFile(PatchFile.c_str());
 	}
-	return true;
+	FreeFolder(&Old);
+	FreeFolder(&New);
+
+	if(Result)
+	{
+		static char Message[512];
+		sprintf(Message, "Patch successfully created\r\n\r\n%d files added, %d changed (%d as deltas), %d removed", NumAdded, NumChanged, NumDeltas, NumRemoved);
+		MessageBox(Dialog, Message, "Success", MB_OK | MB_ICONINFORMATION);
+	}
+	return Result;
 }
 
-bool UnpackPackage(FileType f, const std::string &InstallPath)
+// -pack builds a package without the dialog, for build scripts. With "-" as the package it goes
+// to stdout, so it can be piped on without a temporary file: nothing is read back or seeked to,
+// the offsets are counted while writing.
+bool PackFolder(const std::string &ModFolder, const std::string &PackageFile)
 {
-	ModPackageHeader h;
-	Read(f, &h.ID, 5);
-	Read(f, &h.Version, sizeof(int));
-	
-	if(strcmp(h.ID, "E4MP"))
+	Headless = true;
+	std::string Folder = NormalizeFolder(ModFolder);
+	std::string ModName = GetModFolderName(Folder);
+	if(ModName.empty() || !IsPatchPathSafe(ModName))
 	{
-		MessageBox(Dialog, "This is not a valid modification package.", "Corrupt file", MB_OK | MB_ICONSTOP);
+		ShowError("Could not tell the name of the modification from " + ModFolder, "Error");
 		return false;
 	}
-	
-	if(h.Version > FILEVERSION)
+	DWORD Attributes = GetFileAttributes(Folder.c_str());
+	if(Attributes == INVALID_FILE_ATTRIBUTES || !(Attributes & FILE_ATTRIBUTE_DIRECTORY))
 	{
-		MessageBox(Dialog, "This modification package format is newer than the latest supported version. Please go to the Emergency 4 website to obtain an Emergency 4 program update.", "File too new", MB_OK | MB_ICONSTOP);
+		ShowError("Could not read the modification folder " + Folder, "Error");
 		return false;
 	}
-	
-	int l = 0;
-	Read(f, &l, sizeof(int));
-	if(l==0)
-		return false;
-	static char MyName[MAX_PATH];
-	Read(f, MyName, l);
-	SetCurrentDirectory(InstallPath.c_str());
-	if(SetCurrentDirectory(MyName)!=0)
+	if(!InitPackProfile())
 	{
-		MessageBox(Dialog, "There appears to be a modification with the same name installed. Can't install modification.\n\nRemove or rename the existent modification folder in order to install this modification package.", "Error", MB_OK | MB_ICONSTOP);
+		ShowError("Could not load the packing profile " + ProfileFile, "Error");
 		return false;
 	}
-	
-	int cd = CreateDirectory(MyName, NULL);
-	assert(cd != 0);	
-	int scd = SetCurrentDirectory(MyName);
-	assert(scd != 0);
-	
-	std::string Outpath = InstallPath + "\\" + MyName;
-	std::vector<FileEntry*> Files;
-	CreateStructure(f, MyName, Outpath, Files);
-	
-	ShowWindow(Progress, SW_SHOW);
-	if(!UnpackFiles(f, Files))
+
+	bool Stream = PackageFile == "-";
+	FileType f = NULL;
+	if(Stream)
 	{
-		MessageBox(Dialog, "The mod package is corrupted", "Fatal Error", MB_OK | MB_ICONSTOP);
+		_setmode(_fileno(stdout), _O_BINARY);
+#ifdef COMPRESS_PACKAGE
+		f = gzdopen(_fileno(stdout), "wb");
+#else
+		f = stdout;
+#endif
+	} else
+		f = Open(PackageFile.c_str(), "wb");
+	if(!f)
+	{
+		ShowError("Could not create " + PackageFile, "Error");
 		return false;
 	}
-	ShowWindow(Progress, SW_HIDE);
-	SetActiveWindow(Dialog);
-	BringWindowToTop(Dialog);
-	Files.clear();
 
-	// Create Key File
-	std::string keyFileName = InstallPath + "\\" + MyName + "\\e4mod.key" ;
-	FILE* keyFile = fopen(keyFileName.c_str(), "wb");
-	if (!keyFile)
+	ModContents Contents;
+	Contents.Name = ModName;
+	ScanSubFolder(&Contents, Folder);
+	std::string Dictionary;
+	if(UseDictionary)
+		BuildDictionary(&Contents, Dictionary);
+
+	ModPackageHeader h;
+	strcpy(h.ID, "E4MP");
+	h.Version = FILEVERSION;
+	h.ChunkSize = GetPackChunkSize();
+	Write(f, h.ID, 5);
+	Write(f, &h.Version, sizeof(int));
+	Write(f, &h.ChunkSize, sizeof(int));
+	__int64 Position = PACKAGE_HEADERSIZE + WriteDictionary(f, Dictionary);
+
+	bool Result = CopyFiles(f, Position, &Contents, h.ChunkSize, Dictionary, NULL);
+	if(Result)
 	{
-		MessageBox(Dialog, "Could not create key file. Aborting.", "Fatal Error", MB_OK | MB_ICONSTOP);
-		return false;
+		int DirectorySize = WritePackageInfo(f, &Contents);
+		Result = WritePackageFooter(f, Position, DirectorySize);
 	}
+#ifdef COMPRESS_PACKAGE
+	Result = Close(f) == Z_OK && Result;
+#else
+	Result = (Stream ? fflush(f) : Close(f)) == 0 && Result;
+#endif
+	FreeFolder(&Contents);
 
-	CComputerCheckSum generator;
-	unsigned long checkSum = generator.GetComputerChecksum();
-	fwrite(&checkSum,1,sizeof(checkSum),keyFile);
-	fclose(keyFile);
+	if(!Result)
+	{
+		ShowError("Could not write " + PackageFile, "Fatal error");
+		if(!Stream)
+			DeleteFile(PackageFile.c_str());
+		return false;
+	}
+	fputs(GetPackReport().c_str(), stderr);
 	return true;
 }
 
-bool MakePackage(int Item)
+// removes what an unfinished patch left next to the installed files, the folders it created last
+void DeletePatchFiles(const PatchOperationList &Operations, const std::string &ModPath, const StringList &Folders)
 {
-	LPARAM value = SendMessage(GetDlgItem(Dialog, IDC_MODLIST), LB_GETITEMDATA, (WPARAM)Item, 0);
-	if(value == LB_ERR)
-		return false;
+	for(PatchOperationList::const_iterator i = Operations.begin(); i != Operations.end(); i++)
+	{
+		std::string Path = ModPath + "\\" + i->Path;
+		if(i->Type == PATCH_DELTA)
+			DeleteFile((Path + ".e4delta").c_str());
+		if(i->Type == PATCH_ADD || i->Type == PATCH_REPLACE || i->Type == PATCH_DELTA)
+			DeleteFile((Path + ".e4new").c_str());
+	}
+	for(StringList::const_reverse_iterator i = Folders.rbegin(); i != Folders.rend(); i++)
+		RemoveDirectory(i->c_str());
+}
 
-	ModListInfo *mli = reinterpret_cast<ModListInfo*>(value);
-	assert(mli);
-	if(!mli)
-		return false;
-		
-	std::string filename = ChooseDestinationPackage();
-	if(filename.length()==0)
+// Applies a patch package onto the installed mod. Nothing is touched unless every file the
+// patch changes is the version it was made for.
+bool ApplyPatch(FileType f, const ModPackageHeader &h, const std::string &Dictionary, const std::string &InstallPath)
+{
+	std::string ModName;
+	PatchOperationList Operations;
+	CDirectoryReader Directory;
+	if(h.Version < 0x00000106 || !Directory.Load(f, h.Version) || !ReadPatchInfo(Directory, ModName, Operations))
+	{
+		MessageBox(Dialog, "The mod package is corrupted", "Fatal Error", MB_OK | MB_ICONSTOP);
 		return false;
-	FileType f = Open(filename.c_str(), "wb");
-	assert(f);
-	if(!f)
+	}
+
+	std::string ModPath = InstallPath + "\\" + ModName;
+	DWORD Attributes = GetFileAttributes(ModPath.c_str());
+	if(Attributes == INVALID_FILE_ATTRIBUTES || !(Attributes & FILE_ATTRIBUTE_DIRECTORY))
+	{
+		std::string Message = "The modification this patch is for is not installed\n\n" + ModName;
+		MessageBox(Dialog, Message.c_str(), "Error", MB_OK | MB_ICONSTOP);
 		return false;
-	
-	ModPackageHeader h;
-	strcpy(h.ID, "E4MP");
-	h.ID[4]=0;
-	h.Version = FILEVERSION;
-	Write(f, h.ID, 5);
-	Write(f, &h.Version, sizeof(int));
-	
-	EnableWindow(Dialog, FALSE);
+	}
+
+	CContentHasher Hasher;
+	for(PatchOperationList::iterator i = Operations.begin(); i != Operations.end(); i++)
+	{
+		if(i->Type != PATCH_REPLACE && i->Type != PATCH_DELTA)
+			continue;
+		PumpMessages();
+		std::string Path = ModPath + "\\" + i->Path;
+		WIN32_FILE_ATTRIBUTE_DATA fa;
+		ContentHash Digest;
+		if(!GetFileAttributesEx(Path.c_str(), GetFileExInfoStandard, &fa) || (((__int64)fa.nFileSizeHigh << 32) | fa.nFileSizeLow) != i->BaseSize ||
+			!Hasher.HashFile(Path, Digest) || Digest != i->BaseHash)
+		{
+			std::string Message = "The installed modification does not match the version this patch was made for\n\n" + Path;
+			MessageBox(Dialog, Message.c_str(), "Error", MB_OK | MB_ICONSTOP);
+			return false;
+		}
+	}
+
+	// the files are named by their path inside the mod. Nothing installed is touched before
+	// every new file is complete, so a failure leaves the old version as it was.
 	ShowWindow(Progress, SW_SHOW);
-	static char defdir[1024];
-	int r = mli->Path.find_last_of('\\', mli->Path.length())+1;
-	int l = mli->Path.length() - r;
-	mli->Contents.Name = mli->Path.substr(r, l);
-	WritePackageInfo(f, &mli->Contents);
-	int null = 0;
-	Write(f, &null, sizeof(int));
-	CopyFiles(f, &mli->Contents);
-	Seek(f, 9, SEEK_SET);
-	
-	// nochmal, diesmal mit korrekten fileoffsets
-	WritePackageInfo(f, &mli->Contents);
+	ModContents Patched;
+	Patched.Path = ModPath;
+	StringList Created;		// the folders that did not exist yet
+	for(PatchOperationList::iterator i = Operations.begin(); i != Operations.end(); i++)
+	{
+		std::string Path = ModPath + "\\" + i->Path;
+		if(i->Type == PATCH_MKDIR && CreateDirectory(Path.c_str(), NULL))
+			Created.push_back(Path);
+		if(i->Type != PATCH_ADD && i->Type != PATCH_REPLACE && i->Type != PATCH_DELTA)
+			continue;
+		FileEntry *e = AddFileEntry(&Patched, (i->Path + (i->Type == PATCH_DELTA ? ".e4delta" : ".e4new")).c_str());
+		e->DataOffset = i->Entry.DataOffset;
+		e->DataSize = i->Entry.DataSize;
+		e->Hash = i->Entry.Hash;
+		e->SolidOffset = i->Entry.SolidOffset;
+	}
+	std::vector<FileEntry*> Files;
+	CollectFiles(&Patched, Files);
+	if(!UnpackFiles(f, Files, h.ChunkSize, Dictionary))
+	{
+		DeletePatchFiles(Operations, ModPath, Created);
+		ShowWindow(Progress, SW_HIDE);
+		MessageBox(Dialog, "The mod package is corrupted", "Fatal Error", MB_OK | MB_ICONSTOP);
+		return false;
+	}
+
+	for(PatchOperationList::iterator i = Operations.begin(); i != Operations.end(); i++)
+	{
+		if(i->Type != PATCH_DELTA)
+			continue;
+		PumpMessages();
+		std::string Path = ModPath + "\\" + i->Path;
+		std::string Delta = Path + ".e4delta";
+		bool Applied = ApplyDelta(Path, Delta, Path + ".e4new", i->Hash);
+		DeleteFile(Delta.c_str());
+		if(!Applied)
+		{
+			DeletePatchFiles(Operations, ModPath, Created);
+			ShowWindow(Progress, SW_HIDE);
+			std::string Message = "Could not apply the patch to\n\n" + Path;
+			MessageBox(Dialog, Message.c_str(), "Fatal error", MB_OK | MB_ICONSTOP);
+			return false;
+		}
+	}
+
+	bool Result = true;
+	for(PatchOperationList::iterator i = Operations.begin(); i != Operations.end(); i++)
+	{
+		PumpMessages();
+		std::string Path = ModPath + "\\" + i->Path;
+		switch(i->Type)
+		{
+			case PATCH_ADD :
+			case PATCH_REPLACE :
+			case PATCH_DELTA :
+				if(!MoveFileEx((Path + ".e4new").c_str(), Path.c_str(), MOVEFILE_REPLACE_EXISTING))
+				{
+					DeleteFile((Path + ".e4new").c_str());
+					std::string Message = "Could not replace\n\n" + Path;
+					MessageBox(Dialog, Message.c_str(), "Fatal error", MB_OK | MB_ICONSTOP);
+					Result = false;
+				}
+				break;
+			case PATCH_REMOVE :
+				DeleteFile(Path.c_str());
+				break;
+			case PATCH_RMDIR :
+				RemoveDirectory(Path.c_str());
+				break;
+		}
+	}
 	ShowWindow(Progress, SW_HIDE);
 	SetActiveWindow(Dialog);
 	BringWindowToTop(Dialog);
-	
-	Close(f);
-	EnableWindow(Dialog, TRUE);
-	return true;
+	return Result;
 }
 
 bool UnInstall(int Item)
@@ -817,6 +3450,10 @@ bool InstallPackage(const std::string &Path)
 		MessageBox(Dialog, "Could not open source file. Aborting.", "Fatal Error", MB_OK | MB_ICONSTOP);
 		return false;
 	}
+#ifndef COMPRESS_PACKAGE
+	// the package is read front to back, so let stdio fetch it in large blocks
+	setvbuf(f, NULL, _IOFBF, 0x100000);
+#endif
 	
 	EnableWindow(Dialog, FALSE);
 	std::string dest = EM3InstallDir + "\\mods";
@@ -887,7 +3524,10 @@ BOOL CALLBACK DialogProc(HWND hwndDlg, UINT uMsg, WPARAM wParam, LPARAM lParam)
 						{
 							ScanModContents(SelItem);
 							if(MakePackage(SelItem))
-								MessageBox(Dialog, "Package successfully created", "Operation completed", MB_OK | MB_ICONINFORMATION);
+							{
+								std::string Message = "Package successfully created\r\n\r\n" + PackReport;
+								MessageBox(Dialog, Message.c_str(), "Operation completed", MB_OK | MB_ICONINFORMATION);
+							}
 							else
 								MessageBox(Dialog, "Could not create package", "Operation failed", MB_OK | MB_ICONSTOP);
 							InitMods();
@@ -954,15 +3594,7 @@ bool InitDialog()
 
 void UnInitContents(ModContents *Contents)
 {
-	for(std::list<ModContents*>::iterator i = Contents->SubFolders.begin(); i != Contents->SubFolders.end(); i++)
-	{
-		UnInitContents(*i);
-		delete (*i);
-	}
-	for(std::list<FileEntry*>::iterator i = Contents->Files.begin(); i != Contents->Files.end(); i++)
-		delete (*i);
-	Contents->SubFolders.clear();
-	Contents->Files.clear();
+	FreeFolder(Contents);
 }
 
 void UnInitMods()
@@ -1025,8 +3657,132 @@ bool InitMods()
 	return true;
 }
 
+void SplitCommandLine(const char *CmdLine, StringList &Args)
+{
+	const char *p = CmdLine;
+	while(*p)
+	{
+		while(*p == ' ' || *p == '\t')
+			p++;
+		if(!*p)
+			break;
+		std::string Arg;
+		bool Quoted = false;
+		while(*p && (Quoted || (*p != ' ' && *p != '\t')))
+		{
+			if(*p == '"')
+				Quoted = !Quoted;
+			else
+				Arg += *p;
+			p++;
+		}
+		Args.push_back(Arg);
+	}
+}
+
+// handles the switches and returns what is left, i.e. the package to install
+std::string ParseCommandLine(const char *CmdLine)
+{
+	StringList Args;
+	SplitCommandLine(CmdLine, Args);
+
+	std::string Rest;
+	for(unsigned int i = 0; i < Args.size(); i++)
+	{
+		if((!_stricmp(Args[i].c_str(), "-threads") || !_stricmp(Args[i].c_str(), "/threads")) && i+1 < Args.size())
+		{
+			NumWorkerThreads = atoi(Args[++i].c_str());
+			if(NumWorkerThreads > MAX_WORKER_THREADS)
+				NumWorkerThreads = MAX_WORKER_THREADS;
+			continue;
+		}
+		if((!_stricmp(Args[i].c_str(), "-profile") || !_stricmp(Args[i].c_str(), "/profile")) && i+1 < Args.size())
+		{
+			ProfileFile = Args[++i];
+			continue;
+		}
+		if((!_stricmp(Args[i].c_str(), "-makepatch") || !_stricmp(Args[i].c_str(), "/makepatch")) && i+3 < Args.size())
+		{
+			MakePatchArgs.assign(Args.begin() + i + 1, Args.begin() + i + 4);
+			i += 3;
+			continue;
+		}
+		if((!_stricmp(Args[i].c_str(), "-pack") || !_stricmp(Args[i].c_str(), "/pack")) && i+2 < Args.size())
+		{
+			PackArgs.assign(Args.begin() + i + 1, Args.begin() + i + 3);
+			i += 2;
+			continue;
+		}
+		if((!_stricmp(Args[i].c_str(), "-extract") || !_stricmp(Args[i].c_str(), "/extract")) && i+3 < Args.size())
+		{
+			ExtractArgs.assign(Args.begin() + i + 1, Args.begin() + i + 4);
+			i += 3;
+			continue;
+		}
+		if((!_stricmp(Args[i].c_str(), "-cat") || !_stricmp(Args[i].c_str(), "/cat")) && i+2 < Args.size())
+		{
+			CatArgs.assign(Args.begin() + i + 1, Args.begin() + i + 3);
+			i += 2;
+			continue;
+		}
+		if(!_stricmp(Args[i].c_str(), "-full") || !_stricmp(Args[i].c_str(), "/full"))
+		{
+			FullRepack = true;
+			continue;
+		}
+		if(!_stricmp(Args[i].c_str(), "-nodictionary") || !_stricmp(Args[i].c_str(), "/nodictionary"))
+		{
+			UseDictionary = false;
+			continue;
+		}
+		if(!_stricmp(Args[i].c_str(), "-stats") || !_stricmp(Args[i].c_str(), "/stats"))
+		{
+			ShowStats = true;
+			continue;
+		}
+		if((!_stricmp(Args[i].c_str(), "-chunksize") || !_stricmp(Args[i].c_str(), "/chunksize")) && i+1 < Args.size())
+		{
+			int KB = atoi(Args[++i].c_str());
+			PackChunkSize = KB > MAX_CHUNKSIZE / 1024 ? MAX_CHUNKSIZE : KB * 1024;
+			continue;
+		}
+		if((!_stricmp(Args[i].c_str(), "-solid") || !_stricmp(Args[i].c_str(), "/solid")) && i+1 < Args.size())
+		{
+			int KB = atoi(Args[++i].c_str());
+			SolidBlockSize = KB > MAX_CHUNKSIZE / 1024 ? MAX_CHUNKSIZE : KB * 1024;
+			continue;
+		}
+		if(Rest.length() > 0)
+			Rest += " ";
+		Rest += Args[i];
+	}
+	return Rest;
+}
+
 int __stdcall WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nShowCmd)
 {
+	std::string AutoInstall = ParseCommandLine(lpCmdLine);
+	if(MakePatchArgs.size() == 3)
+		return MakePatch(MakePatchArgs[0], MakePatchArgs[1], MakePatchArgs[2]) ? 0 : 1;
+	if(PackArgs.size() == 2)
+		return PackFolder(PackArgs[0], PackArgs[1]) ? 0 : 1;
+	if(ExtractArgs.size() == 3)
+	{
+		Headless = true;
+		int NumExtracted = 0;
+		if(!ExtractFiles(ExtractArgs[0], ExtractArgs[1], ExtractArgs[2], NumExtracted))
+			return 1;
+		fprintf(stderr, "%d files extracted\n", NumExtracted);
+		if(ShowStats)
+			fputs(InstallReport.c_str(), stderr);
+		return NumExtracted > 0 ? 0 : 2;
+	}
+	if(CatArgs.size() == 2)
+	{
+		Headless = true;
+		return CatFile(CatArgs[0], CatArgs[1]) ? 0 : 1;
+	}
+
 	if(!GetInstallDir())
 	{
 #ifndef EM4_DELUXE
@@ -1041,14 +3797,13 @@ int __stdcall WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdL
 	if(!InitMods())
 		return -1;
 	
-	std::string AutoInstall = lpCmdLine;
 	if(AutoInstall.length() > 0)
 	{
 		static char str[2048];
-		sprintf(str, "This will install the modification from package %s to %s\\Mods.\n\nContinue?", lpCmdLine, EM3InstallDir.c_str());
+		sprintf(str, "This will install the modification from package %s to %s\\Mods.\n\nContinue?", AutoInstall.c_str(), EM3InstallDir.c_str());
 		if(MessageBox(Dialog, str, "Install package?", MB_YESNO | MB_ICONQUESTION)==IDYES)
 		{
-			InstallPackage(lpCmdLine);
+			InstallPackage(AutoInstall);
 			InitMods();
 			SetActiveWindow(Dialog);
 			BringWindowToTop(Dialog);
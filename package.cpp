@@ -0,0 +1,553 @@
+/*
+	Emergency 4 (Deluxe) ModInstaller 
+	Copyright (c) 2009 sixteen tons entertainment/Promotion Software GmbH (www.sixteen-tons.de)
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "packageio.h"
+#include <map>
+
+#pragma warning(disable: 4267 4244)
+
+volatile LONG NumBufferAllocations = 0;	// heap allocations for zlib state and chunk buffers
+
+int Write(FileType f, const void *data, int size)
+{
+#ifdef COMPRESS_PACKAGE
+	return gzwrite(f, data, size);
+#else
+	return fwrite(data, 1, size, f);
+#endif
+}
+
+int Read(FileType f, void *data, int size)
+{
+#ifdef COMPRESS_PACKAGE
+	return gzread(f, data, size);
+#else
+	return fread(data, 1, size, f);
+#endif
+}
+
+FileEntry *AddFileEntry(ModContents *Folder, const char *Name)
+{
+	FileEntry e;
+	e.Folder = Folder;
+	e.NameOffset = Folder->Names.size();
+	e.DataOffset = 0;
+	e.DataSize = 0;
+	e.WriteTime = 0;
+	e.SolidOffset = -1;
+	Folder->Names.insert(Folder->Names.end(), Name, Name + strlen(Name) + 1);
+	Folder->Files.push_back(e);
+	return &Folder->Files.back();
+}
+
+void FreeFolder(ModContents *Node)
+{
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	{
+		FreeFolder(*i);
+		delete (*i);
+	}
+	std::vector<FileEntry>().swap(Node->Files);
+	std::vector<char>().swap(Node->Names);
+	std::vector<ModContents*>().swap(Node->SubFolders);
+}
+
+// zlib state is recycled instead of going back to the heap. The block sizes only depend
+// on the stream parameters, so there are just a handful of different ones.
+class CBlockPool
+{
+public:
+	CBlockPool()
+	{
+		InitializeCriticalSection(&mLock);
+	}
+	~CBlockPool()
+	{
+		for(std::map<unsigned int, std::vector<void*> >::iterator i = mFree.begin(); i != mFree.end(); i++)
+			for(std::vector<void*>::iterator b = i->second.begin(); b != i->second.end(); b++)
+				free(*b);
+		DeleteCriticalSection(&mLock);
+	}
+	void *Alloc(unsigned int Size)
+	{
+		void *Block = NULL;
+		EnterCriticalSection(&mLock);
+		std::vector<void*> &Blocks = mFree[Size];
+		if(!Blocks.empty())
+		{
+			Block = Blocks.back();
+			Blocks.pop_back();
+		}
+		LeaveCriticalSection(&mLock);
+
+		if(!Block)
+		{
+			Block = malloc(HEADERSIZE + Size);
+			if(!Block)
+				return NULL;
+			*reinterpret_cast<unsigned int*>(Block) = Size;
+			InterlockedIncrement(&NumBufferAllocations);
+		}
+		return reinterpret_cast<char*>(Block) + HEADERSIZE;
+	}
+	void Free(void *Address)
+	{
+		void *Block = reinterpret_cast<char*>(Address) - HEADERSIZE;
+		EnterCriticalSection(&mLock);
+		mFree[*reinterpret_cast<unsigned int*>(Block)].push_back(Block);
+		LeaveCriticalSection(&mLock);
+	}
+
+private:
+	enum { HEADERSIZE = 16 };	// keeps the blocks aligned like malloc does
+	CRITICAL_SECTION mLock;
+	std::map<unsigned int, std::vector<void*> > mFree;
+};
+
+CBlockPool ZlibBlocks;
+
+voidpf ZlibAlloc(voidpf opaque, uInt items, uInt size)
+{
+	return reinterpret_cast<CBlockPool*>(opaque)->Alloc(items * size);
+}
+
+void ZlibFree(voidpf opaque, voidpf address)
+{
+	reinterpret_cast<CBlockPool*>(opaque)->Free(address);
+}
+
+int CompressChunk(WorkerContext *Context, int Level, int Strategy, Bytef *dest, uLongf *destLen, const Bytef *source, uLong sourceLen, const Bytef *dictionary, uInt dictLength)
+{
+	z_stream &s = Context->Deflate;
+	if(!Context->DeflateReady)
+	{
+		s.zalloc = ZlibAlloc;
+		s.zfree = ZlibFree;
+		s.opaque = &ZlibBlocks;
+		int err = deflateInit2(&s, Level, Z_DEFLATED, MAX_WBITS, 8, Strategy);
+		if(err != Z_OK)
+			return err;
+		Context->DeflateReady = true;
+	} else
+	{
+		deflateReset(&s);
+		// nothing has been fed to the stream yet, so this only switches the parameters
+		if(Level != Context->DeflateLevel || Strategy != Context->DeflateStrategy)
+		{
+			int err = deflateParams(&s, Level, Strategy);
+			if(err != Z_OK)
+				return err;
+		}
+	}
+	Context->DeflateLevel = Level;
+	Context->DeflateStrategy = Strategy;
+	if(dictionary)
+	{
+		int err = deflateSetDictionary(&s, dictionary, dictLength);
+		if(err != Z_OK)
+			return err;
+	}
+
+	s.next_in = const_cast<Bytef*>(source);
+	s.avail_in = sourceLen;
+	s.next_out = dest;
+	s.avail_out = *destLen;
+	int err = deflate(&s, Z_FINISH);
+	if(err != Z_STREAM_END)
+		return err == Z_OK ? Z_BUF_ERROR : err;
+	*destLen = s.total_out;
+	return Z_OK;
+}
+
+int UncompressChunk(WorkerContext *Context, Bytef *dest, uLongf *destLen, const Bytef *source, uLong sourceLen, const Bytef *dictionary, uInt dictLength)
+{
+	z_stream &s = Context->Inflate;
+	if(!Context->InflateReady)
+	{
+		s.zalloc = ZlibAlloc;
+		s.zfree = ZlibFree;
+		s.opaque = &ZlibBlocks;
+		s.next_in = Z_NULL;
+		s.avail_in = 0;
+		int err = inflateInit(&s);
+		if(err != Z_OK)
+			return err;
+		Context->InflateReady = true;
+	} else
+		inflateReset(&s);
+
+	s.next_in = const_cast<Bytef*>(source);
+	s.avail_in = sourceLen;
+	s.next_out = dest;
+	s.avail_out = *destLen;
+	int err = inflate(&s, Z_FINISH);
+	if(err == Z_NEED_DICT && dictionary)
+	{
+		err = inflateSetDictionary(&s, dictionary, dictLength);
+		if(err == Z_OK)
+			err = inflate(&s, Z_FINISH);
+	}
+	if(err != Z_STREAM_END)
+	{
+		if(err == Z_NEED_DICT || (err == Z_BUF_ERROR && s.avail_in == 0))
+			return Z_DATA_ERROR;
+		return err == Z_OK ? Z_BUF_ERROR : err;
+	}
+	*destLen = s.total_out;
+	return Z_OK;
+}
+
+bool ReadDictionary(FileType File, int Version, std::string &Dictionary)
+{
+	Dictionary.clear();
+	if(Version < 0x00000108)
+		return true;
+	int Size = 0;
+	if(Read(File, &Size, sizeof(int)) != sizeof(int) || Size < 0 || Size > DICTIONARY_SIZE)
+		return false;
+	if(Size == 0)
+		return true;
+	// packages may be mounted on several threads at once
+	std::vector<Bytef> Packed(DICTIONARY_SIZE + DICTIONARY_SIZE / 512 + 64);
+	std::vector<char> Data(Size);
+	uLongf PackedSize = 0;
+	if(Read(File, &PackedSize, sizeof(uLongf)) != sizeof(uLongf) || PackedSize > Packed.size() || Read(File, &Packed[0], PackedSize) != PackedSize)
+		return false;
+	uLongf DataSize = Size;
+	if(uncompress((Bytef*)&Data[0], &DataSize, &Packed[0], PackedSize) != Z_OK || DataSize != Size)
+		return false;
+	Dictionary.assign(&Data[0], Size);
+	return true;
+}
+
+bool SeekDirectory(FileType f, int Version, int &Size)
+{
+	int FooterSize = Version >= 0x00000105 ? PACKAGE_FOOTERSIZE : OLD_FOOTERSIZE;
+#ifdef COMPRESS_PACKAGE
+	// gz streams can't seek from the end, the whole package has to be inflated once to find it
+	std::vector<char> Skip(0x10000);
+	z_off_t End = gztell(f);
+	int r;
+	while((r = gzread(f, &Skip[0], Skip.size())) > 0)
+		End += r;
+	if(End < FooterSize || gzseek(f, End - FooterSize, SEEK_SET) < 0)
+		return false;
+	__int64 FooterOffset = End - FooterSize;
+#else
+	if(_fseeki64(f, -FooterSize, SEEK_END))
+		return false;
+	__int64 FooterOffset = _ftelli64(f);
+#endif
+
+	ModPackageFooter Footer;
+	if(Version >= 0x00000105)
+		Read(f, &Footer.DirectoryOffset, sizeof(__int64));
+	else
+	{
+		int Offset = 0;
+		Read(f, &Offset, sizeof(int));
+		Footer.DirectoryOffset = Offset;
+	}
+	Read(f, &Footer.DirectorySize, sizeof(int));
+	if(Read(f, Footer.ID, 5) != 5 || strcmp(Footer.ID, "E4MD"))
+		return false;
+	if(Footer.DirectoryOffset < 0 || Footer.DirectorySize <= 0 || Footer.DirectoryOffset + Footer.DirectorySize != FooterOffset)
+		return false;
+
+	Seek(f, Footer.DirectoryOffset, SEEK_SET);
+	Size = Footer.DirectorySize;
+	return Tell(f) == Footer.DirectoryOffset;
+}
+
+std::string FoldPath(const std::string &Path)
+{
+	std::string Folded = Path;
+	for(unsigned int i = 0; i < Folded.length(); i++)
+		Folded[i] = Folded[i] == '/' ? '\\' : tolower((unsigned char)Folded[i]);
+	return Folded;
+}
+
+bool ReadStructure(CDirectoryReader &Directory, ModContents *Node, int Version)
+{
+	int NumFolders = Directory.GetCount();
+	if(NumFolders < 0)
+		return false;
+	for(int i=0; i<NumFolders; i++)
+	{
+		ModContents *con = new ModContents;
+		Node->SubFolders.push_back(con);
+		if(!Directory.GetName(con->Name))
+			return false;
+	}
+
+	int NumFiles = Directory.GetCount();
+	if(NumFiles < 0)
+		return false;
+	// the count is not trusted further than the directory could hold, a file takes at least
+	// its name length, one character and a 32 bit offset and size
+	int Remaining = Directory.GetRemaining();
+	if(Remaining >= 0)
+	{
+		int MaxFiles = Remaining / (int)(3 * sizeof(int) + 1);
+		Node->Files.reserve(NumFiles < MaxFiles ? NumFiles : MaxFiles);
+	}
+	for(int i=0; i<NumFiles; i++)
+	{
+		std::string Name;
+		if(!Directory.GetName(Name))
+			return false;
+		FileEntry *e = AddFileEntry(Node, Name.c_str());
+		if(Version >= 0x00000105)
+		{
+			if(!Directory.Get(e->DataOffset) || !Directory.Get(e->DataSize))
+				return false;
+		} else
+		{
+			int Offs, Size;
+			if(!Directory.Get(Offs) || !Directory.Get(Size))
+				return false;
+			e->DataOffset = Offs;
+			e->DataSize = Size;
+		}
+		if(Version >= 0x00000106)
+		{
+			if(!Directory.Get(e->WriteTime) || !Directory.GetData(e->Hash.Value, 20))
+				return false;
+			e->Hash.Valid = true;
+		}
+		if(Version >= 0x00000107 && !Directory.Get(e->SolidOffset))
+			return false;
+	}
+	
+	// every folder repeats its name in front of its contents
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+	{
+		std::string Name;
+		if(!Directory.GetName(Name) || !ReadStructure(Directory, *i, Version))
+			return false;
+	}
+	return true;
+}
+
+void SetFolderPaths(ModContents *Node, const std::string &Path)
+{
+	Node->Path = Path;
+	for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+		SetFolderPaths(*i, Path + "\\" + (*i)->Name);
+}
+
+bool ReadPackageContents(FileType f, int Version, ModContents &Contents)
+{
+	CDirectoryReader Directory;
+	return Directory.Load(f, Version) && Directory.GetName(Contents.Name) && ReadStructure(Directory, &Contents, Version);
+}
+
+PackageError ReadPackageHeader(FileType f, ModPackageHeader &h, std::string &Dictionary)
+{
+	memset(&h, 0, sizeof(h));
+	Read(f, &h.ID, 5);
+	Read(f, &h.Version, sizeof(int));
+	if(strcmp(h.ID, "E4MP") && strcmp(h.ID, "E4PT"))
+		return PACKAGE_INVALID;
+	if(h.Version > FILEVERSION)
+		return PACKAGE_TOO_NEW;
+
+	h.ChunkSize = OLD_CHUNKSIZE;
+	if(h.Version >= 0x00000103)
+	{
+		Read(f, &h.ChunkSize, sizeof(int));
+		if(h.ChunkSize < MIN_CHUNKSIZE || h.ChunkSize > MAX_CHUNKSIZE)
+			return PACKAGE_CORRUPT;
+	}
+	if(!ReadDictionary(f, h.Version, Dictionary))
+		return PACKAGE_CORRUPT;
+	return PACKAGE_OK;
+}
+
+CPackageStream::CPackageStream(CPackageFileSystem *FileSystem, const FileEntry *Entry)
+{
+	mFileSystem = FileSystem;
+	mEntry = Entry;
+	mPosition = 0;
+	mCurrent = -1;
+	mContext = new WorkerContext;
+}
+
+CPackageStream::~CPackageStream()
+{
+	delete mContext;
+}
+
+// walks the chunk headers up to the one holding Position
+bool CPackageStream::FindChunk(__int64 Position, int &Index)
+{
+	while(mChunks.empty() || mChunks.back().Start + mChunks.back().Size <= Position)
+	{
+		Chunk c;
+		if(mChunks.empty())
+		{
+			c.Offset = mEntry->DataOffset;
+			c.Start = mEntry->SolidOffset >= 0 ? -mEntry->SolidOffset : 0;
+		} else
+		{
+			// a solid block is a single chunk
+			if(mEntry->SolidOffset >= 0)
+				return false;
+			c.Offset = mChunks.back().Offset + sizeof(uLongf) + sizeof(int) + mChunks.back().InputSize;
+			c.Start = mChunks.back().Start + mChunks.back().Size;
+		}
+		if(!mFileSystem->ReadChunkHeader(c.Offset, c.InputSize, c.Stored, c.Size))
+			return false;
+		mChunks.push_back(c);
+	}
+
+	int First = 0, Last = mChunks.size() - 1;
+	while(First < Last)
+	{
+		int Middle = (First + Last) / 2;
+		if(mChunks[Middle].Start + mChunks[Middle].Size <= Position)
+			First = Middle + 1;
+		else
+			Last = Middle;
+	}
+	Index = First;
+	return true;
+}
+
+bool CPackageStream::LoadChunk(__int64 Position)
+{
+	if(mCurrent >= 0 && Position >= mChunks[mCurrent].Start && Position < mChunks[mCurrent].Start + mChunks[mCurrent].Size)
+		return true;
+	int Index = 0;
+	if(!FindChunk(Position, Index))
+		return false;
+
+	mCurrent = -1;
+	const Chunk &c = mChunks[Index];
+	mData.resize(c.Size);
+	unsigned char *Input = &mData[0];
+	if(!c.Stored)
+	{
+		mInput.resize(c.InputSize > 0 ? c.InputSize : 1);
+		Input = &mInput[0];
+	}
+	if(!mFileSystem->ReadChunkData(c.Offset, Input, c.InputSize))
+		return false;
+	if(!c.Stored)
+	{
+		uLongf Size = c.Size;
+		const std::string &Dictionary = mFileSystem->mDictionary;
+		if(UncompressChunk(mContext, &mData[0], &Size, Input, c.InputSize, (const Bytef*)Dictionary.data(), Dictionary.length()) != Z_OK || Size != (uLongf)c.Size)
+			return false;
+	}
+	mCurrent = Index;
+	return true;
+}
+
+CPackageFileSystem::CPackageFileSystem()
+{
+	mFile = NULL;
+	mIndex = new CPathIndex;
+	InitializeCriticalSection(&mLock);
+}
+
+CPackageFileSystem::~CPackageFileSystem()
+{
+	Unmount();
+	delete mIndex;
+	DeleteCriticalSection(&mLock);
+}
+
+bool CPackageFileSystem::Mount(const std::string &PackageFile)
+{
+	Unmount();
+	mFile = Open(PackageFile.c_str(), "rb");
+	if(!mFile)
+		return false;
+	if(ReadPackageHeader(mFile, mHeader, mDictionary) != PACKAGE_OK || strcmp(mHeader.ID, "E4MP") || !ReadPackageContents(mFile, mHeader.Version, mContents))
+	{
+		Unmount();
+		return false;
+	}
+	mIndex->Build(&mContents);
+	return true;
+}
+
+void CPackageFileSystem::Unmount()
+{
+	if(mFile)
+		Close(mFile);
+	mFile = NULL;
+	mIndex->Clear();
+	FreeFolder(&mContents);
+	mDictionary.clear();
+}
+
+bool CPackageFileSystem::Stat(const std::string &Path, PackageEntryInfo &Info) const
+{
+	if(const FileEntry *e = mIndex->FindFile(Path))
+	{
+		SetInfo(Info, e);
+		return true;
+	}
+	if(const ModContents *Node = mIndex->FindFolder(Path))
+	{
+		SetInfo(Info, Node);
+		return true;
+	}
+	return false;
+}
+
+bool CPackageFileSystem::ListFolder(const std::string &Path, std::vector<PackageEntryInfo> &Entries) const
+{
+	const ModContents *Node = mIndex->FindFolder(Path);
+	if(!Node)
+		return false;
+	Entries.resize(Node->SubFolders.size() + Node->Files.size());
+	for(unsigned int i = 0; i < Node->SubFolders.size(); i++)
+		SetInfo(Entries[i], Node->SubFolders[i]);
+	for(unsigned int i = 0; i < Node->Files.size(); i++)
+		SetInfo(Entries[Node->SubFolders.size() + i], &Node->Files[i]);
+	return true;
+}
+
+CPackageStream *CPackageFileSystem::OpenStream(const std::string &Path)
+{
+	const FileEntry *e = mIndex->FindFile(Path);
+	return e ? new CPackageStream(this, e) : NULL;
+}
+
+bool CPackageFileSystem::ReadChunkHeader(__int64 Offset, uLongf &InputSize, bool &Stored, int &Size)
+{
+	EnterCriticalSection(&mLock);
+	InputSize = 0;
+	Size = 0;
+	bool Result = Seek(mFile, Offset, SEEK_SET) >= 0 && Read(mFile, &InputSize, sizeof(uLongf)) == sizeof(uLongf) && Read(mFile, &Size, sizeof(int)) == sizeof(int);
+	LeaveCriticalSection(&mLock);
+	Stored = (InputSize & CHUNK_STORED) != 0;
+	InputSize &= ~(CHUNK_STORED | CHUNK_DICTIONARY);
+	return Result && InputSize <= compressBound(mHeader.ChunkSize) && Size > 0 && Size <= mHeader.ChunkSize && (!Stored || InputSize == (uLongf)Size);
+}
+
+bool CPackageFileSystem::ReadChunkData(__int64 Offset, unsigned char *Data, uLongf Size)
+{
+	EnterCriticalSection(&mLock);
+	bool Result = Seek(mFile, Offset + sizeof(uLongf) + sizeof(int), SEEK_SET) >= 0 && Read(mFile, Data, Size) == Size;
+	LeaveCriticalSection(&mLock);
+	return Result;
+}
@@ -0,0 +1,284 @@
+/*
+	Emergency 4 (Deluxe) ModInstaller 
+	Copyright (c) 2009 sixteen tons entertainment/Promotion Software GmbH (www.sixteen-tons.de)
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The modification package format and read-only access to the files of a package without the
+// installer dialog. Reading and writing the format itself is in packageio.h.
+
+#ifndef PACKAGE_H
+#define PACKAGE_H
+
+#include <windows.h>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+#include "thirdparty/zlib/zlib.h"
+
+//#define COMPRESS_PACKAGE
+
+// a package is a gz stream as a whole with COMPRESS_PACKAGE
+#ifdef COMPRESS_PACKAGE
+typedef gzFile PackageHandle;
+#else
+typedef FILE *PackageHandle;
+#endif
+
+// SHA-1 of file contents, kept inline so that hashing a file allocates nothing
+struct ContentHash
+{
+	unsigned char Value[20];
+	bool Valid;		// false until the file is hashed
+
+	ContentHash()
+	{
+		Valid = false;
+	}
+
+	// two hashes only match if both are known
+	bool operator==(const ContentHash &h) const
+	{
+		return Valid && h.Valid && !memcmp(Value, h.Value, sizeof(Value));
+	}
+	bool operator!=(const ContentHash &h) const
+	{
+		return !(*this == h);
+	}
+	bool operator<(const ContentHash &h) const
+	{
+		return memcmp(Value, h.Value, sizeof(Value)) < 0;
+	}
+};
+
+struct ModContents;
+
+struct FileEntry
+{
+	ModContents *Folder;	// the file is Folder->Path + "\\" + its name
+	int NameOffset;		// into the names of Folder
+	__int64 DataOffset;
+	__int64 DataSize;	// size of the source as scanned until it is packed
+	__int64 WriteTime;	// FILETIME of the source, since 0x00000106
+	ContentHash Hash;	// of the contents, since 0x00000106
+	int SolidOffset;	// position inside the solid block at DataOffset, -1 if the file has chunks of its own, since 0x00000107
+};
+
+// Files are stored by value and their names are pooled per folder, so a folder costs a few
+// allocations no matter how many files it has. Entries are referred to by pointer once the
+// folder is complete, it must not grow after that.
+struct ModContents
+{
+	std::string Name;
+	std::string Path;
+	std::vector<FileEntry> Files;
+	std::vector<char> Names;	// each one terminated by a zero
+	std::vector<ModContents*> SubFolders;
+};
+
+// adds a file to the folder, the entry is valid until the next one is added
+FileEntry *AddFileEntry(ModContents *Folder, const char *Name);
+
+inline const char *GetName(const FileEntry *e)
+{
+	return &e->Folder->Names[e->NameOffset];
+}
+
+inline std::string GetPath(const FileEntry *e)
+{
+	return e->Folder->Path + "\\" + GetName(e);
+}
+
+// the files go with their folder, only the folders are allocated one by one
+void FreeFolder(ModContents *Node);
+
+#define PACKAGE_HEADERSIZE	13	// ID, version and chunk size as written, the dictionary follows since 0x00000108
+
+struct ModPackageHeader
+{
+	char ID[5];		// E3MP
+	int Version;	// 0x00000101, 0x00000102: stored chunks, 0x00000103: chunk size, 0x00000104: directory at the end, 0x00000105: 64 bit offsets, 0x00000106: write times and hashes, 0x00000107: solid blocks, 0x00000108: preset dictionary
+	int ChunkSize;	// uncompressed size of a full chunk, since 0x00000103
+};
+
+// last bytes of the package since 0x00000104
+struct ModPackageFooter
+{
+	__int64 DirectoryOffset;	// 4 bytes in 0x00000104
+	int DirectorySize;
+	char ID[5];		// E4MD
+};
+
+#define PACKAGE_FOOTERSIZE	17	// as written, without padding
+#define OLD_FOOTERSIZE		13	// 0x00000104
+
+#define OLD_CHUNKSIZE		0xffff		// fixed in packages before 0x103
+#define DEFAULT_CHUNKSIZE	0x40000
+#define MIN_CHUNKSIZE		0x10000
+#define MAX_CHUNKSIZE		0x400000
+#define CHUNK_STORED		0x80000000	// set in the compressed size of chunks that are not deflated
+#define CHUNK_DICTIONARY	0x40000000	// set in the compressed size of chunks primed with the preset dictionary
+#define DICTIONARY_SIZE		0x8000		// the deflate window, more could never be referenced
+
+// what Stat and ListFolder tell about a file or folder of a mounted package
+struct PackageEntryInfo
+{
+	std::string Name;
+	bool Folder;
+	__int64 Size;
+	__int64 WriteTime;	// FILETIME, 0 before 0x00000106
+};
+
+class CPackageFileSystem;
+class CPathIndex;
+struct WorkerContext;
+
+// A file of a mounted package. Its chunks are found by walking their headers as far as reads
+// reach, and a chunk is inflated when a read first needs it. The last one is kept, so reading
+// in small pieces inflates every chunk once.
+class CPackageStream
+{
+public:
+	~CPackageStream();
+
+	// returns the number of bytes read, 0 at the end and -1 if the package is corrupted
+	int ReadData(void *Data, int Size)
+	{
+		int Done = 0;
+		while(Done < Size && mPosition < mEntry->DataSize)
+		{
+			if(!LoadChunk(mPosition))
+				return -1;
+			const Chunk &c = mChunks[mCurrent];
+			__int64 End = c.Start + c.Size < mEntry->DataSize ? c.Start + c.Size : mEntry->DataSize;
+			int n = End - mPosition < Size - Done ? (int)(End - mPosition) : Size - Done;
+			memcpy((char*)Data + Done, &mData[(size_t)(mPosition - c.Start)], n);
+			Done += n;
+			mPosition += n;
+		}
+		return Done;
+	}
+
+	// like fseek, positions past the end read nothing
+	bool SetPosition(__int64 Offset, int Origin)
+	{
+		__int64 Base = Origin == SEEK_CUR ? mPosition : Origin == SEEK_END ? mEntry->DataSize : 0;
+		if(Base + Offset < 0)
+			return false;
+		mPosition = Base + Offset;
+		return true;
+	}
+
+	__int64 GetPosition() const
+	{
+		return mPosition;
+	}
+
+	__int64 GetSize() const
+	{
+		return mEntry->DataSize;
+	}
+
+private:
+	friend class CPackageFileSystem;
+
+	struct Chunk
+	{
+		__int64 Offset;		// of its header in the package
+		__int64 Start;		// position of its first byte in the file, negative inside a solid block
+		int Size;
+		uLongf InputSize;
+		bool Stored;
+	};
+
+	CPackageStream(CPackageFileSystem *FileSystem, const FileEntry *Entry);
+
+	bool FindChunk(__int64 Position, int &Index);
+	bool LoadChunk(__int64 Position);
+
+	CPackageFileSystem *mFileSystem;
+	const FileEntry *mEntry;
+	__int64 mPosition;
+	std::vector<Chunk> mChunks;		// the ones found so far
+	int mCurrent;					// the one in mData, -1 if none
+	std::vector<unsigned char> mData;
+	std::vector<unsigned char> mInput;
+	WorkerContext *mContext;
+};
+
+// Read-only access to the files of a package without installing it. Paths are relative to the
+// mod folder and compared like Windows does. Several threads may read at once, each through
+// streams of its own.
+class CPackageFileSystem
+{
+public:
+	CPackageFileSystem();
+	~CPackageFileSystem();
+
+	// reads the directory, the data is left in the package until it is read
+	bool Mount(const std::string &PackageFile);
+
+	// all streams must have been deleted
+	void Unmount();
+
+	// the name of the folder the package installs to
+	const std::string &GetModName() const
+	{
+		return mContents.Name;
+	}
+
+	bool Stat(const std::string &Path, PackageEntryInfo &Info) const;
+
+	// the folders first, both in package order
+	bool ListFolder(const std::string &Path, std::vector<PackageEntryInfo> &Entries) const;
+
+	// NULL if there is no such file, the stream is deleted by the caller
+	CPackageStream *OpenStream(const std::string &Path);
+
+private:
+	friend class CPackageStream;
+
+	static void SetInfo(PackageEntryInfo &Info, const FileEntry *e)
+	{
+		Info.Name = GetName(e);
+		Info.Folder = false;
+		Info.Size = e->DataSize;
+		Info.WriteTime = e->WriteTime;
+	}
+
+	static void SetInfo(PackageEntryInfo &Info, const ModContents *Node)
+	{
+		Info.Name = Node->Name;
+		Info.Folder = true;
+		Info.Size = 0;
+		Info.WriteTime = 0;
+	}
+
+	// the header of the chunk at Offset, checked as UnpackFile does
+	bool ReadChunkHeader(__int64 Offset, uLongf &InputSize, bool &Stored, int &Size);
+
+	bool ReadChunkData(__int64 Offset, unsigned char *Data, uLongf Size);
+
+	PackageHandle mFile;
+	ModPackageHeader mHeader;
+	std::string mDictionary;
+	ModContents mContents;
+	CPathIndex *mIndex;
+	CRITICAL_SECTION mLock;		// for the file position
+};
+
+#endif
@@ -0,0 +1,381 @@
+/*
+	Emergency 4 (Deluxe) ModInstaller 
+	Copyright (c) 2009 sixteen tons entertainment/Promotion Software GmbH (www.sixteen-tons.de)
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Reading and writing packages, shared by the installer and package.cpp. Not part of the package
+// library interface, which would have its Open(), Close() and the like renamed by the macros.
+
+#ifndef PACKAGEIO_H
+#define PACKAGEIO_H
+
+#include "package.h"
+#include <algorithm>
+
+#define FILEVERSION 0x00000108
+
+#ifdef COMPRESS_PACKAGE
+	#define FileType gzFile
+	#define Open gzopen
+	#define Close gzclose
+	#define Seek gzseek
+	#define Tell gztell
+#else
+	#define FileType FILE*
+	#define Open fopen
+	#define Close fclose
+	#define Seek _fseeki64
+	#define Tell _ftelli64
+#endif
+
+int Write(FileType f, const void *data, int size);
+int Read(FileType f, void *data, int size);
+
+extern volatile LONG NumBufferAllocations;	// heap allocations for zlib state and chunk buffers
+
+// Per worker thread state. compress()/uncompress() set up and tear down a complete
+// deflate/inflate state for every chunk, here the streams live as long as the thread
+// and are only reset between chunks. The same goes for the chunk buffer.
+struct WorkerContext
+{
+	z_stream Deflate;
+	bool DeflateReady;
+	int DeflateLevel;
+	int DeflateStrategy;
+	z_stream Inflate;
+	bool InflateReady;
+	unsigned char *Buffer;
+	unsigned int BufferSize;
+
+	WorkerContext()
+	{
+		DeflateReady = InflateReady = false;
+		Buffer = NULL;
+		BufferSize = 0;
+	}
+	~WorkerContext()
+	{
+		if(DeflateReady)
+			deflateEnd(&Deflate);
+		if(InflateReady)
+			inflateEnd(&Inflate);
+		delete [] Buffer;
+	}
+	unsigned char *GetBuffer(unsigned int Size)
+	{
+		if(Size > BufferSize)
+		{
+			delete [] Buffer;
+			Buffer = new unsigned char[Size];
+			BufferSize = Size;
+			InterlockedIncrement(&NumBufferAllocations);
+		}
+		return Buffer;
+	}
+};
+
+// same result as compress2() with the given level and strategy, primed with the dictionary if there is one
+int CompressChunk(WorkerContext *Context, int Level, int Strategy, Bytef *dest, uLongf *destLen, const Bytef *source, uLong sourceLen, const Bytef *dictionary, uInt dictLength);
+
+// same result as uncompress(), the dictionary is only needed for chunks that were primed with it
+int UncompressChunk(WorkerContext *Context, Bytef *dest, uLongf *destLen, const Bytef *source, uLong sourceLen, const Bytef *dictionary, uInt dictLength);
+
+bool ReadDictionary(FileType File, int Version, std::string &Dictionary);
+
+// moves to the directory the footer points to
+bool SeekDirectory(FileType f, int Version, int &Size);
+
+#define DIRECTORY_BLOCKSIZE	0x10000
+
+// The package directory, read in one piece and decoded from memory. Packages before
+// 0x00000104 have no footer telling its size, there it is read block by block as it is
+// decoded.
+class CDirectoryReader
+{
+public:
+	CDirectoryReader()
+	{
+		mFile = NULL;
+		mPosition = 0;
+	}
+
+	// to be called where the directory starts for packages without a footer
+	bool Load(FileType f, int Version)
+	{
+		mData.clear();
+		mPosition = 0;
+		mFile = NULL;
+		if(Version < 0x00000104)
+		{
+			mFile = f;
+			return true;
+		}
+
+		int Size = 0;
+		if(!SeekDirectory(f, Version, Size))
+			return false;
+		mData.resize(Size);
+		return Read(f, &mData[0], Size) == Size;
+	}
+
+	bool GetData(void *Data, int Size)
+	{
+		if(Size < 0 || !Fill(Size))
+			return false;
+		memcpy(Data, &mData[mPosition], Size);
+		mPosition += Size;
+		return true;
+	}
+
+	template<class T> bool Get(T &Value)
+	{
+		return GetData(&Value, sizeof(T));
+	}
+
+	// names are stored with their terminating zero
+	bool GetName(std::string &Name)
+	{
+		int l = 0;
+		if(!Get(l) || l <= 0 || l > MAX_PATH || !Fill(l))
+			return false;
+		const char *p = &mData[mPosition];
+		Name.assign(p, std::find(p, p + l, 0) - p);
+		mPosition += l;
+		return true;
+	}
+
+	int GetCount()
+	{
+		int Count = -1;
+		if(!Get(Count))
+			return -1;
+		return Count;
+	}
+
+	// bytes left to decode, -1 if the directory is read as it is decoded
+	int GetRemaining() const
+	{
+		return mFile ? -1 : (int)(mData.size() - mPosition);
+	}
+
+private:
+	bool Fill(int Size)
+	{
+		if(mData.size() - mPosition >= (size_t)Size)
+			return true;
+		if(!mFile)
+			return false;
+
+		mData.erase(mData.begin(), mData.begin() + mPosition);
+		mPosition = 0;
+		while(mData.size() < (size_t)Size)
+		{
+			size_t Have = mData.size();
+			mData.resize(Have + DIRECTORY_BLOCKSIZE);
+			int r = Read(mFile, &mData[Have], DIRECTORY_BLOCKSIZE);
+			mData.resize(Have + (r > 0 ? r : 0));
+			if(r <= 0)
+				return false;
+		}
+		return true;
+	}
+
+	FileType mFile;
+	std::vector<char> mData;
+	size_t mPosition;
+};
+
+// paths inside a package are compared like Windows does
+std::string FoldPath(const std::string &Path);
+
+// only names the folders, SetFolderPaths places them
+bool ReadStructure(CDirectoryReader &Directory, ModContents *Node, int Version);
+
+void SetFolderPaths(ModContents *Node, const std::string &Path);
+
+// the directory of a package that is not a patch, the root is named after the mod
+bool ReadPackageContents(FileType f, int Version, ModContents &Contents);
+
+// Paths inside a package, relative to the mod folder and compared like Windows does, mapped to
+// their entries and folders. Per file only the hash is kept, a hit is confirmed against the
+// path of its folder and its name.
+class CPathIndex
+{
+public:
+	CPathIndex()
+	{
+		mMask = 0;
+	}
+
+	void Build(ModContents *Root)
+	{
+		Clear();
+		int NumEntries = 0;
+		AddFolder(Root, "", NumEntries);
+
+		unsigned int Size = 16;
+		while(Size < (unsigned int)NumEntries * 2)
+			Size <<= 1;
+		Slot Empty = { 0, -1, NULL };
+		mSlots.assign(Size, Empty);
+		mMask = Size - 1;
+
+		for(unsigned int i = 0; i < mFolders.size(); i++)
+		{
+			unsigned int Hash = HashPath(PATHHASH_BASIS, mFolders[i].Path.c_str());
+			Insert(Hash, i, NULL);
+			if(!mFolders[i].Path.empty())
+				Hash = HashPath(Hash, "\\");
+			std::vector<FileEntry> &Files = mFolders[i].Node->Files;
+			for(std::vector<FileEntry>::iterator j = Files.begin(); j != Files.end(); j++)
+				Insert(HashPath(Hash, GetName(&*j)), i, &*j);
+		}
+	}
+
+	void Clear()
+	{
+		std::vector<Folder>().swap(mFolders);
+		std::vector<Slot>().swap(mSlots);
+		mMask = 0;
+	}
+
+	FileEntry *FindFile(const std::string &Path) const
+	{
+		const Slot *s = Find(Path, true);
+		return s ? s->File : NULL;
+	}
+
+	// "" is the mod folder itself
+	ModContents *FindFolder(const std::string &Path) const
+	{
+		const Slot *s = Find(Path, false);
+		return s ? mFolders[s->Folder].Node : NULL;
+	}
+
+private:
+	struct Folder
+	{
+		ModContents *Node;
+		std::string Path;	// folded, without a trailing backslash
+	};
+
+	struct Slot
+	{
+		unsigned int Hash;
+		int Folder;			// -1 if the slot is free
+		FileEntry *File;	// NULL for the folder itself
+	};
+
+	enum { PATHHASH_BASIS = 2166136261u };
+
+	static char FoldChar(char c)
+	{
+		return c == '/' ? '\\' : (char)tolower((unsigned char)c);
+	}
+
+	// FNV-1a over the folded characters, continuing from Hash
+	static unsigned int HashPath(unsigned int Hash, const char *Path)
+	{
+		for(; *Path; Path++)
+			Hash = (Hash ^ (unsigned char)FoldChar(*Path)) * 16777619u;
+		return Hash;
+	}
+
+	void AddFolder(ModContents *Node, const std::string &Path, int &NumEntries)
+	{
+		Folder f;
+		f.Node = Node;
+		f.Path = Path;
+		mFolders.push_back(f);
+		NumEntries += 1 + Node->Files.size();
+		for(std::vector<ModContents*>::iterator i = Node->SubFolders.begin(); i != Node->SubFolders.end(); i++)
+			AddFolder(*i, FoldPath(Path.empty() ? (*i)->Name : Path + "\\" + (*i)->Name), NumEntries);
+	}
+
+	// the first of several entries that fold to the same path wins
+	void Insert(unsigned int Hash, int FolderIndex, FileEntry *File)
+	{
+		unsigned int i = Hash & mMask;
+		for(; mSlots[i].Folder >= 0; i = (i + 1) & mMask)
+		{
+			if(mSlots[i].Hash == Hash && (mSlots[i].File != NULL) == (File != NULL) && Matches(mSlots[i], File ? Join(FolderIndex, File) : mFolders[FolderIndex].Path))
+				return;
+		}
+		mSlots[i].Hash = Hash;
+		mSlots[i].Folder = FolderIndex;
+		mSlots[i].File = File;
+	}
+
+	std::string Join(int FolderIndex, const FileEntry *File) const
+	{
+		const std::string &Path = mFolders[FolderIndex].Path;
+		return FoldPath(Path.empty() ? std::string(GetName(File)) : Path + "\\" + GetName(File));
+	}
+
+	// Folded is the path to look for, already folded
+	bool Matches(const Slot &s, const std::string &Folded) const
+	{
+		const std::string &Path = mFolders[s.Folder].Path;
+		if(!s.File)
+			return Path == Folded;
+
+		size_t Start = 0;
+		if(!Path.empty())
+		{
+			if(Folded.length() <= Path.length() || Folded.compare(0, Path.length(), Path) || Folded[Path.length()] != '\\')
+				return false;
+			Start = Path.length() + 1;
+		}
+		const char *Name = GetName(s.File);
+		for(size_t i = Start; i < Folded.length(); i++, Name++)
+		{
+			if(!*Name || FoldChar(*Name) != Folded[i])
+				return false;
+		}
+		return !*Name;
+	}
+
+	const Slot *Find(const std::string &Path, bool IsFile) const
+	{
+		if(mSlots.empty())
+			return NULL;
+		std::string Folded = FoldPath(Path);
+		unsigned int Hash = HashPath(PATHHASH_BASIS, Folded.c_str());
+		for(unsigned int i = Hash & mMask; mSlots[i].Folder >= 0; i = (i + 1) & mMask)
+		{
+			if(mSlots[i].Hash == Hash && (mSlots[i].File != NULL) == IsFile && Matches(mSlots[i], Folded))
+				return &mSlots[i];
+		}
+		return NULL;
+	}
+
+	std::vector<Folder> mFolders;
+	std::vector<Slot> mSlots;
+	unsigned int mMask;
+};
+
+enum PackageError
+{
+	PACKAGE_OK,
+	PACKAGE_INVALID,
+	PACKAGE_TOO_NEW,
+	PACKAGE_CORRUPT
+};
+
+// reads everything in front of the chunks, patches included
+PackageError ReadPackageHeader(FileType f, ModPackageHeader &h, std::string &Dictionary);
+
+#endif